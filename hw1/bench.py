@@ -0,0 +1,247 @@
+#!/usr/bin/env python3
+"""
+bench.py - benchmarks Far on synthetic trees
+  Builds reproducible trees (many tiny files, a few huge files, deep nesting,
+  one wide directory, sparse files) in a scratch directory, times Far r, t, x
+  and d on each, and prints one JSON document with the results so that runs
+  of different builds can be compared.  For every command it reports the
+  wall and cpu time, files/sec and MB/s over the tree, the peak resident set
+  of Far, and the read and write system calls Far made (syscr and syscw of
+  /proc/PID/io, read just before the exit status is collected, since neither
+  strace nor perf can be relied on to be installed).  Fragmentation is
+  reported as the number of extents (FIEMAP) of the archive after r, t and
+  d, and of all the extracted files together after x.
+
+  usage: bench.py [--far ./Far] [--scale 1.0] [--seed 323] [--dir DIR]
+                  [--options "--nocache ..."] [--trees tiny,wide]
+                  [--output FILE] [--keep]
+  Runs use a warm page cache, since every tree is timed right after it is
+  written.
+"""
+
+import argparse
+import fcntl
+import json
+import os
+import random
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+KB = 1024
+MB = 1024*KB
+FS_IOC_FIEMAP = 0xC020660B
+FIEMAP_FLAG_SYNC = 1
+
+
+def write_file(path, size, rng):
+    with open(path, "wb") as f:
+        while size > 0:
+            n = min(size, MB)
+            f.write(rng.randbytes(n))
+            size -= n
+
+
+# each generator builds its tree under root and returns nothing; sizes are
+# multiplied by scale, and all contents come from rng
+def tiny_files(root, scale, rng):
+    for d in range(100):
+        os.makedirs(os.path.join(root, "d%03d" % d))
+        for f in range(max(1, int(100*scale))):
+            write_file(os.path.join(root, "d%03d" % d, "f%03d" % f),
+                       rng.randrange(1024), rng)
+
+
+def huge_files(root, scale, rng):
+    os.makedirs(root)
+    for f in range(4):
+        write_file(os.path.join(root, "huge%d" % f), int(64*MB*scale), rng)
+
+
+def deep_nesting(root, scale, rng):
+    path = root
+    for d in range(max(1, int(200*scale))):
+        path = os.path.join(path, "n%d" % d)
+        os.makedirs(path)
+        write_file(os.path.join(path, "f"), rng.randrange(4*KB), rng)
+
+
+def wide_directory(root, scale, rng):
+    os.makedirs(root)
+    for f in range(max(1, int(10000*scale))):
+        write_file(os.path.join(root, "w%05d" % f), rng.randrange(256), rng)
+
+
+def sparse_files(root, scale, rng):
+    os.makedirs(root)
+    for f in range(4):
+        size = int(64*MB*scale)
+        with open(os.path.join(root, "sparse%d" % f), "wb") as out:
+            out.truncate(size)
+            for _ in range(8):  # a few scattered data blocks, holes elsewhere
+                out.seek(rng.randrange(max(1, size - 64*KB)))
+                out.write(rng.randbytes(min(size, 64*KB)))
+
+
+TREES = [("tiny", tiny_files), ("huge", huge_files), ("deep", deep_nesting),
+         ("wide", wide_directory), ("sparse", sparse_files)]
+
+
+def tree_size(root):
+    files, size = 0, 0
+    for path, dirs, names in os.walk(root):
+        files += len(dirs) + len(names)
+        size += sum(os.lstat(os.path.join(path, n)).st_size for n in names)
+    return files + 1, size
+
+
+def extents(path):
+    """returns the number of extents of a file, or of all the files under a
+    directory, or None if the file system does not report them"""
+    if os.path.isdir(path):
+        total = 0
+        for root, dirs, names in os.walk(path):
+            for name in names:
+                count = extents(os.path.join(root, name))
+                if count is None:
+                    return None
+                total += count
+        return total
+    # struct fiemap with no room for extents returns just their number
+    request = struct.pack("=QQIIII", 0, 2**64 - 1, FIEMAP_FLAG_SYNC, 0, 0, 0)
+    try:
+        with open(path, "rb") as f:
+            reply = fcntl.ioctl(f.fileno(), FS_IOC_FIEMAP, request)
+    except OSError:
+        return None
+    return struct.unpack("=QQIIII", reply)[3]
+
+
+def run(args, cwd):
+    """runs Far and returns its wall time, rusage and /proc/PID/io counters"""
+    start = time.monotonic()
+    child = subprocess.Popen(args, cwd=cwd, stdout=subprocess.DEVNULL,
+                             stderr=subprocess.PIPE)
+    child.stderr.read()
+    # wait without reaping, so that /proc/PID/io can still be read
+    os.waitid(os.P_PID, child.pid, os.WEXITED | os.WNOWAIT)
+    wall = time.monotonic() - start
+    io = {}
+    try:
+        with open("/proc/%d/io" % child.pid) as f:
+            for line in f:
+                key, value = line.split(":")
+                io[key] = int(value)
+    except OSError:
+        pass
+    _, status, usage = os.wait4(child.pid, 0)
+    return wall, usage, io, os.waitstatus_to_exitcode(status)
+
+
+def measure(tree, op, args, cwd, files, size, written):
+    wall, usage, io, status = run(args, cwd)
+    return {
+        "tree": tree,
+        "op": op,
+        "status": status,
+        "files": files,
+        "bytes": size,
+        "seconds": round(wall, 6),
+        "user_seconds": round(usage.ru_utime, 6),
+        "system_seconds": round(usage.ru_stime, 6),
+        "files_per_sec": round(files/wall, 1) if wall > 0 else None,
+        "mb_per_sec": round(size/MB/wall, 2) if wall > 0 else None,
+        "peak_rss_kb": usage.ru_maxrss,
+        "read_syscalls": io.get("syscr"),
+        "write_syscalls": io.get("syscw"),
+        "read_bytes": io.get("rchar"),
+        "written_bytes": io.get("wchar"),
+        "extents": extents(written),
+    }
+
+
+def git_revision():
+    try:
+        return subprocess.run(["git", "rev-parse", "--short", "HEAD"],
+                              capture_output=True, text=True,
+                              cwd=os.path.dirname(os.path.abspath(__file__)),
+                              check=True).stdout.strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def main():
+    parser = argparse.ArgumentParser(description="benchmarks Far")
+    parser.add_argument("--far", default="./Far", help="Far binary to time")
+    parser.add_argument("--scale", type=float, default=1.0,
+                        help="multiplies the number and size of files")
+    parser.add_argument("--seed", type=int, default=323,
+                        help="seed of the tree contents")
+    parser.add_argument("--dir", help="scratch directory (default: a new "
+                        "temporary directory)")
+    parser.add_argument("--options", default="",
+                        help="options passed to every Far command")
+    parser.add_argument("--trees", default=",".join(n for n, _ in TREES),
+                        help="comma separated trees to run (default: all)")
+    parser.add_argument("--output", help="file to write the JSON to "
+                        "(default: standard output)")
+    parser.add_argument("--keep", action="store_true",
+                        help="keep the scratch directory")
+    args = parser.parse_args()
+
+    far = os.path.abspath(args.far)
+    options = args.options.split()
+    scratch = args.dir or tempfile.mkdtemp(prefix="farbench.")
+    os.makedirs(scratch, exist_ok=True)
+    trees = args.trees.split(",")
+    unknown = set(trees) - set(n for n, _ in TREES)
+    if unknown:
+        parser.error("unknown trees: " + ", ".join(sorted(unknown)))
+    results = []
+    try:
+        for name, generate in TREES:
+            if name not in trees:
+                continue
+            work = os.path.join(scratch, name)
+            shutil.rmtree(work, ignore_errors=True)
+            os.makedirs(work)
+            generate(os.path.join(work, name), args.scale,
+                     random.Random("%d-%s" % (args.seed, name)))
+            files, size = tree_size(os.path.join(work, name))
+            archive = os.path.join(work, "bench.far")
+            out = os.path.join(work, "extracted")
+            os.makedirs(out)
+            first = sorted(os.listdir(os.path.join(work, name)))[0]
+
+            results.append(measure(name, "r", [far, "r"] + options +
+                                   [archive, name], work, files, size,
+                                   archive))
+            results.append(measure(name, "t", [far, "t"] + options +
+                                   [archive], work, files, size, archive))
+            results.append(measure(name, "x", [far, "x"] + options +
+                                   [archive], out, files, size, out))
+            results.append(measure(name, "d", [far, "d"] + options +
+                                   [archive, os.path.join(name, first)],
+                                   work, files, size, archive))
+            if not args.keep:
+                shutil.rmtree(work)
+            print("bench: %s done" % name, file=sys.stderr)
+    finally:
+        if not args.keep and not args.dir:
+            shutil.rmtree(scratch, ignore_errors=True)
+
+    report = {"far": far, "revision": git_revision(), "scale": args.scale,
+              "seed": args.seed, "options": options, "results": results}
+    text = json.dumps(report, indent=2) + "\n"
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(text)
+    else:
+        sys.stdout.write(text)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,277 @@
+/*
+  far.h - interface to libfar, the archive engine behind Far
+    libfar reads and writes Far archives: a member table can be iterated,
+    single members can be opened as streams, and paths can be appended or
+    members deleted.  Far itself is a thin command line wrapper around
+    farRun().  The library keeps no global state: each farArchive handle
+    owns everything it uses, so threads may work on different archives at
+    the same time (a single handle must not be shared between threads).
+*/
+
+#ifndef FAR_INCLUDED
+#define FAR_INCLUDED
+
+#include <linux/limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#define MAXLEN (PATH_MAX+2)
+#define DURABLENONE 0 //durability level that never syncs
+#define DURABLEBATCH 1 //durability level that syncs in batches
+#define DURABLESTRICT 2 //durability level that syncs every file
+
+//node for stack or linked list
+//name hold a strings of a filename, *next is a pointer to another node
+typedef struct node_t
+{
+  char name[MAXLEN];
+  struct node_t* next;
+} node;
+
+//stack struct
+//contains a pointer to the head node, an int containing the stack size and
+//the number of names compared by searches of the stack so far
+typedef struct stack_t
+{
+  node *head;
+  int size;
+  long long compares;
+} stack;
+
+//initializes a new stack
+void stackInit(stack *s);
+
+//mallocs a node with the string nodeName and pushes it to stack s
+void stackPush(stack *s, const char *nodeName);
+
+//frees all nodes in the stack, leaving the stack empty
+void freeStack(stack *s);
+
+//check if a name is found in a stack. trailing slashes are ignored
+bool isNameInStack(stack *s, const char* name);
+
+//turns trailing slashes in a string to null characters
+void removeTrailingSlashes(char* name);
+
+//entry of an in-memory member table
+//name holds the member name as stored in the archive (directories keep their
+//trailing slash), kind is the mark in front of the size in its header ('\0'
+//for plain members), offset is the position of the first data byte in the
+//archive and size is the length of the data. mtime is the modification time
+//of the archived file in nanoseconds, recorded in the header when the archive
+//is written with the times option (-1 if it was not recorded)
+typedef struct member_t
+{
+  char *name;
+  char kind;
+  long long offset;
+  long long size;
+  long long mtime;
+} member;
+
+//settings given on the command line between the key and the archive name
+//delta appends changed files to the archive as deltas against their
+//archived version (r only)
+//nocache drops the archive, the new archive and the extracted or archived
+//files from the page cache as they are finished with, so that a pass over a
+//large archive does not evict everything else
+//direct reads the existing archive with O_DIRECT, bypassing the page cache
+//(implies nocache, falls back to nocache where O_DIRECT is not supported
+//and for r with delta)
+//cacheReport prints the page cache footprint of the pass on stderr
+//inodeOrder archives the entries of each directory in the order of their
+//data on disk (or of their inode numbers) instead of readdir order, so that
+//reading them takes fewer seeks (r only, names given on the command line
+//keep their order)
+//rangeOffset and rangeLength select the bytes of each member printed by p: a
+//negative offset counts back from the end of the member, and a negative
+//length reaches to the end
+//firstWins keeps a name from the first archive it occurs in when archives
+//are merged by m, instead of from the last one
+//align pads member headers so that the data of every plain member written
+//starts at a multiple of align bytes in the archive, which lets it be read
+//with O_DIRECT, mapped a page at a time or cloned into extracted files (0
+//leaves member data unaligned)
+//readers is the number of threads reading files ahead of the archive writer
+//(r only, 0 reads every file when it is written), holding at most
+//readAheadBytes of file contents in memory
+//checkpoint makes r record every checkpoint seconds how far it got, in
+//ARCHIVE.ckpt next to the ARCHIVE.bak being written, so that the same command
+//run again after a crash continues from there instead of starting over (0
+//does not checkpoint)
+//throttleBytes and throttleOps limit the bytes per second copied by r, x and
+//d, and the reads and writes per second made to copy them, so that a pass
+//leaves disk bandwidth to others (0 leaves it unlimited)
+//interval is how many seconds watch collects changes for before archiving
+//them
+//exclude holds excludeLen shell patterns (see fnmatch) of paths that r and
+//watch leave out: entries matched while walking a directory are skipped
+//without being opened, so nothing under an excluded directory is read. a
+//pattern with a slash is matched against the whole path, any other against
+//its last component
+//stats prints statistics of the pass as JSON on stderr when it ends: wall
+//and cpu time of each phase (walking directories, stat, reading, writing,
+//matching names), bytes moved, members handled, system calls and names
+//compared
+//preallocate lays out the archives r, d and watch write and the files x
+//extracts in large extents: extracted files are preallocated to their
+//length and archives are grown in large preallocated steps, the space left
+//over being freed at the end
+//concurrent makes r, d, m and watch keep an index of the archive in
+//ARCHIVE.idx, so that t, x and p can run while the archive is updated:
+//readers see the members last published there, and writers wait for each
+//other. once the index exists every Far command uses it
+//times records the mtime of every file r and watch archive in its member
+//header, so that diff can tell unchanged files from their metadata alone
+//(archives written with it cannot be read by a Far without it, so r and watch
+//refuse to add members with times to an archive whose files have none)
+//bloom makes r, d, m and watch keep a Bloom filter of the member names in
+//the index of the archive (see concurrent), so that x, d and probe turn away
+//names that are not in the archive without reading it. once the filter
+//exists it is kept up to date by every Far command
+//durability is how far r, d, m, watch and x make sure that what they wrote
+//survives a crash. with DURABLENONE nothing is synced. otherwise a written
+//archive is flushed to disk before it is renamed into place or its appended
+//members are published, and its directory and index are synced after; x
+//syncs the file systems of the extracted files every few seconds and at the
+//end with DURABLEBATCH, and every extracted file and every directory given
+//new entries with DURABLESTRICT
+typedef struct options_t
+{
+  bool delta;
+  bool nocache;
+  bool direct;
+  bool cacheReport;
+  bool inodeOrder;
+  long long rangeOffset;
+  long long rangeLength;
+  bool firstWins;
+  long long align;
+  int readers;
+  long long readAheadBytes;
+  int checkpoint;
+  double throttleBytes;
+  double throttleOps;
+  int interval;
+  char **exclude;
+  int excludeLen;
+  bool stats;
+  bool preallocate;
+  bool concurrent;
+  bool times;
+  bool bloom;
+  int durability;
+} options;
+
+//sets every option to its default
+void optionsInit(options *opts);
+
+//runs one Far command: mode is r, x, d, t, p or m, and names holds the names
+//given on the command line (an empty stack selects every member for x, and
+//for m the names are those of the archives merged into the archive)
+//returns 0 if there is no error, -1 if the archive is corrupted (or for p if
+//a name is not a file in the archive, for m if an input cannot be read, and
+//for r with times if the files of the archive record no times)
+int farRun(const char *archiveName, stack *names, char mode,
+  const options *opts);
+
+//runs the resident server on a unix domain socket for the named archives.
+//SIGPIPE is blocked in the calling thread, so that a client hanging up does
+//not end the process
+//returns only if the server cannot be started
+int farServe(const char *socketName, char *names[], int namesLen);
+
+//sends one request (t, s or x) to a running server and prints the reply
+//returns EXIT_SUCCESS or EXIT_FAILURE
+int farQuery(const char *socketName, const char *key,
+  const char *archiveName, const char *memberName);
+
+//archives the named paths and then watches them with inotify, appending
+//the files that change to the archive in place and deleting the members of
+//those that are removed, in batches every opts->interval seconds. if events
+//are lost, or once the old versions of the files take more space than the
+//latest ones, the named paths are archived again in full, as with r. returns
+//on SIGINT or SIGTERM, after archiving the changes pending. the two are
+//blocked in the calling thread while it watches, so the other threads of the
+//program must block them too
+//returns EXIT_SUCCESS or EXIT_FAILURE
+int farWatch(const char *archiveName, stack *names, const options *opts);
+
+//compares the archive with the named paths on disk (every member if names
+//is empty) and prints A, D or M and the path for every path only on disk,
+//only in the archive or changed. only the member headers and the metadata of
+//the files are read, unless the size of a file matches its member and its
+//mtime was not recorded or differs, in which case the contents are compared
+//returns 0 if nothing differs, 1 if something does, 2 on error
+int farDiff(const char *archiveName, stack *names, const options *opts);
+
+//prints "present name" or "absent name" for every name, telling whether a
+//member of the archive has that name or is under it. names that the Bloom
+//filter of the archive rules out are answered without reading the archive
+//returns 0 if every name is present, 1 if some are not, 2 on error
+int farProbe(const char *archiveName, stack *names, const options *opts);
+
+//prints a JSON report of how the space of the archive is used: members by
+//kind, a histogram of their sizes, live and dead bytes, bytes spent on
+//headers and padding, the average name length and the state of the filter
+//returns EXIT_SUCCESS or EXIT_FAILURE
+int farInfo(const char *archiveName);
+
+//adds the named archives to a catalog of the members of many archives,
+//creating it if needed, and rescans the archives in it that changed
+//returns EXIT_SUCCESS or EXIT_FAILURE
+int farCatalogUpdate(const char *catalogName, char *names[], int namesLen);
+
+//prints the catalog entries for path (which archives hold it), or with under
+//set for every member under the directory path
+//returns EXIT_SUCCESS or EXIT_FAILURE
+int farCatalogFind(const char *catalogName, const char *path, bool under);
+
+//handle on an open archive, holding its member table
+typedef struct farArchive_t farArchive;
+
+//member iterator over an open archive
+typedef struct farIter_t
+{
+  farArchive *archive;
+  int next;
+} farIter;
+
+//opens an archive and reads its member table, creating an empty archive if
+//create is set and the file does not exist
+//returns NULL if the archive cannot be opened or is corrupted
+farArchive *farOpen(const char *archiveName, const options *opts,
+  bool create);
+
+//closes an archive handle and frees everything it holds
+void farClose(farArchive *ar);
+
+//starts an iteration over the members of an archive, in archive order
+void farIterInit(farIter *it, farArchive *ar);
+
+//returns the next member, or NULL after the last one
+const member *farIterNext(farIter *it);
+
+//opens the contents of the member called name (the latest version if the
+//name occurs more than once) as a read-only stream
+//returns NULL if there is no such member or the archive is corrupted
+FILE *farOpenMember(farArchive *ar, const char *name);
+
+//reads up to len bytes of the member called name (the latest version if the
+//name occurs more than once) from offset into buf, without reading the rest
+//of the member
+//returns the number of bytes read, which is short only at the end of the
+//member, or -1 if there is no such member or the archive is corrupted
+long long farReadRange(farArchive *ar, const char *name, void *buf,
+  long long len, long long offset);
+
+//appends the file or directory path to the archive, in place
+//returns 0 if there is no error, -1 otherwise
+int farAppend(farArchive *ar, const char *path);
+
+//deletes every member called name, or under the directory name
+//returns 0 if there is no error, -1 if there is no such member or the
+//archive is corrupted
+int farDelete(farArchive *ar, const char *name);
+
+#endif
@@ -0,0 +1,5741 @@
+/*
+  libfar - the archive engine behind Far
+    Reads, writes and serves Far archives.  An archive is a sequence of
+    members, each a name line followed by a header ([mark]size|) and the
+    member data; see far.h for the interface.
+  Written by Kevin Lai 9/12/12
+*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include "far.h"
+
+#define FARERROR(format,value) (fprintf(stderr,format,value), EXIT_FAILURE)
+#define STDPERM (0777)
+#define LINKMARK '@' //header mark of a member holding the name of its link
+#define DELTAMARK '+' //header mark of a member holding a delta against a base
+#define DELTABLOCKS (1<<24) //base blocks a delta is computed against at most
+#define TIMEMARK '~' //header attribute holding the mtime of the archived file
+#define COPYBUF (64*1024) //block size of copies between files
+#define CACHESTEP (8<<20) //bytes copied between trims of the page cache
+#define CACHESAMPLE (256<<20) //bytes copied between cache footprint samples
+#define DIRECTBUF (1<<20) //size of the buffer of an O_DIRECT stream
+#define DIRECTALIGN 4096 //alignment of O_DIRECT buffers and offsets
+#define NAMEBLOCK 16 //names per block of a front-coded name table
+#define WATCHBUF (64*1024) //size of the buffer inotify events are read into
+#define WATCHEVENTS (IN_CLOSE_WRITE | IN_MODIFY | IN_CREATE | IN_DELETE | \
+  IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF) //watched events
+#define WATCHSLACK 1.0 //dead bytes per live byte past which watch compacts
+#define ARCHIVEFILES 5 //the archive and the files Far keeps next to it
+#define PREALLOCSTEP (64<<20) //bytes an archive being written grows by at once
+#define WRITERLOCK 0 //byte of an archive index locked by the writer
+#define PUBLISHLOCK 1 //byte of an archive index locked to read or publish it
+#define BLOOMBITS 10 //bits of a Bloom filter per name it has room for
+#define BLOOMHASHES 7 //bits of a Bloom filter set by each name
+#define BLOOMMIN 1024 //names a Bloom filter has room for at least
+#define STATWALK 0 //phase of a pass reading directories
+#define STATSTAT 1 //phase of a pass calling lstat
+#define STATREAD 2 //phase of a pass reading files or members
+#define STATWRITE 3 //phase of a pass writing the archive or extracted files
+#define STATMATCH 4 //phase of a pass matching names against stacks
+#define STATPHASES 5 //number of phases of a pass
+#define INFOBUCKETS 64 //buckets of the member size histogram of info
+#define SYNCINTERVAL 2.0 //seconds between file system syncs of a batched x
+#define SERVETIMEOUT 5 //seconds the server waits on a stalled client
+#define THROTTLEBURST 0.05 //seconds of I/O a throttle lets through at once
+
+//state shared by the functions taking part in one pass over an archive
+typedef struct context_t context;
+
+//initializes a new stack
+void stackInit(stack *s)
+{
+  s->size = 0;
+  s->head = NULL;
+  s->compares = 0;
+}
+
+//mallocs a node with the string nodeName and pushes it to stack s
+void stackPush(stack *s, const char *nodeName)
+{
+  node *n = malloc(sizeof(node));
+  strcpy(n->name, nodeName);
+  if(s->size == 0) n->next = NULL;
+  else n->next = s->head;
+  s->head = n;
+  s->size++;
+}
+
+//frees all nodes in the stack, leaving the stack empty
+void freeStack(stack *s)
+{
+  node *temp = s->head;
+  while(temp!=NULL)
+  {
+    s->head = s->head->next;
+    free(temp);
+    temp = s->head;
+  }
+  s->size = 0;
+}
+
+//removes all instances of a name from a stack
+//takes as parameters the name and the stack
+void removeFromStack(stack *s, const char *name)
+{
+  if(s==NULL) return;
+  node *last = NULL;
+  node *temp = s->head;
+  while(temp != NULL)
+  {
+    if(strcmp(name, temp->name) == 0)
+    {
+      if(last == NULL)
+      {
+        s->head = temp->next;
+        free(temp);
+        s->size--;
+        temp = s->head;
+      }
+      else
+      {
+        last->next = temp->next;
+        free(temp);
+        s->size--;
+        temp = last->next;
+      }
+    }
+    else
+    {
+      last = temp;
+      temp = temp->next;
+    }
+  }
+}
+
+//turns trailing slashes in a string to null characters
+void removeTrailingSlashes(char* name)
+{
+  int nameLen = strlen(name);
+  if(nameLen == 1) return;
+  nameLen--;
+  while(name[nameLen] == '/')
+  {
+    name[nameLen--] = '\0';
+    if(nameLen == 1) return;
+  }
+}
+
+//checks if string name is a path prefix of string prefix
+bool checkPrefix(const char *name, const char *prefix)
+{
+  int nameLen = strlen(name);
+  int prefixLen = strlen(prefix);
+  if(nameLen <= prefixLen) return false;
+  if( strncmp(name, prefix, prefixLen) != 0) return false;
+
+  return (name[prefixLen] == '/')? true : false;
+}
+
+//determines if any members of a stack are prefixes of the string "name"
+//returns a pointer to the prefix as well
+bool stackHasPrefix(stack *s, const char *name, char *prefix)
+{
+  if (s==NULL) return false;
+  node* temp = s->head;
+  while(temp != NULL)
+  {
+    s->compares++;
+    if(checkPrefix(name, temp->name))
+    {
+      strcpy(prefix, temp->name);
+      return true;
+    }
+    temp = temp->next;
+  }
+  return false;
+}
+
+//check if name is a prefix of members of the stack
+bool prefixOfStack(stack *s, const char *name)
+{
+  if (s==NULL) return false;
+  node* temp = s->head;
+  while(temp != NULL)
+  {
+    s->compares++;
+    if(checkPrefix(temp->name, name)) return true;
+    temp = temp->next;
+  }
+  return false;
+}
+
+//check if a name is found in a stack. trailing slashes are ignored
+bool isNameInStack(stack *s, const char* name)
+{
+  if(s == NULL) return false;
+  node *temp = s->head;
+  while(temp!=NULL)
+  {
+    s->compares++;
+    int nameLen = strlen(temp->name) + 1;
+    char temp2[nameLen];
+    strcpy(temp2, temp->name);
+    removeTrailingSlashes(temp2);
+    if( strcmp(name, temp2) == 0) return true;
+    temp = temp->next;
+  }
+  return false;
+}
+
+//prints the name contained in each node in the stack. used for debugging
+void printStack(stack *s)
+{
+  printf("Printing stack...\n");
+  node *temp = s->head;
+  while(temp!=NULL)
+  {
+    printf("  %s\n", temp->name);
+    temp = temp->next;
+  }
+  printf("Done printing stack.\n");
+}
+
+//growable array of members, kept in archive order
+typedef struct memberTable_t
+{
+  member *members;
+  int size;
+  int capacity;
+} memberTable;
+
+//initializes a new member table
+void tableInit(memberTable *t)
+{
+  t->members = NULL;
+  t->size = 0;
+  t->capacity = 0;
+}
+
+//copies the member name and appends a member to table t
+void tablePush(memberTable *t, const char *name, char kind,
+  long long offset, long long size, long long mtime)
+{
+  if(t->size == t->capacity)
+  {
+    t->capacity = (t->capacity == 0) ? 64 : 2*t->capacity;
+    t->members = realloc(t->members, t->capacity*sizeof(member));
+  }
+  member *m = &t->members[t->size++];
+  m->name = malloc(strlen(name)+1);
+  strcpy(m->name, name);
+  m->kind = kind;
+  m->offset = offset;
+  m->size = size;
+  m->mtime = mtime;
+}
+
+//frees all members in the table, leaving the table empty
+void freeTable(memberTable *t)
+{
+  for(int i=0;i<t->size;i++) free(t->members[i].name);
+  free(t->members);
+  tableInit(t);
+}
+
+//returns the index of the last member called name, or -1 if there is none.
+//trailing slashes are ignored
+int tableFind(memberTable *t, const char *name)
+{
+  char temp[MAXLEN];
+  for(int i=t->size-1;i>=0;i--)
+  {
+    strcpy(temp, t->members[i].name);
+    removeTrailingSlashes(temp);
+    if(strcmp(name, temp) == 0) return i;
+  }
+  return -1;
+}
+
+//sorted set of distinct names stored front-coded. the names are kept in
+//blocks of NAMEBLOCK: the first name of a block (its head) is stored in full
+//and every other name as the length of the prefix it shares with the name
+//before it followed by the rest of the name. lengths are varints. a name is
+//identified by its position in sorted order
+typedef struct nameTable_t
+{
+  unsigned char *data;
+  long long *heads; //offset in data of each block
+  int size;
+} nameTable;
+
+//appends x to buf at *len as a varint (7 bits per byte, low bits first)
+void putVarint(unsigned char *buf, long long *len, unsigned long long x)
+{
+  for(;x >= 0x80;x >>= 7) buf[(*len)++] = (x & 0x7f) | 0x80;
+  buf[(*len)++] = x;
+}
+
+//reads a varint from *p and advances *p past it
+unsigned long long getVarint(const unsigned char **p)
+{
+  unsigned long long x = 0;
+  for(int shift=0;;shift+=7)
+  {
+    unsigned char b = *(*p)++;
+    x |= (unsigned long long)(b & 0x7f) << shift;
+    if(b < 0x80) return x;
+  }
+}
+
+//builds a name table from an array of n distinct names in strcmp order
+void nameTableBuild(nameTable *nt, char **names, int n)
+{
+  long long cap = 0;
+  for(int i=0;i<n;i++) cap += strlen(names[i]) + 2*10;
+  nt->data = malloc(cap+1);
+  nt->heads = malloc(((n+NAMEBLOCK-1)/NAMEBLOCK + 1)*sizeof(long long));
+  nt->size = n;
+
+  long long len = 0;
+  for(int i=0;i<n;i++)
+  {
+    long long shared = 0, nameLen = strlen(names[i]);
+    if(i % NAMEBLOCK == 0) nt->heads[i/NAMEBLOCK] = len;
+    else
+    {
+      while(names[i][shared] != '\0' && names[i][shared] == names[i-1][shared])
+        shared++;
+      putVarint(nt->data, &len, shared);
+    }
+    putVarint(nt->data, &len, nameLen - shared);
+    memcpy(nt->data + len, names[i] + shared, nameLen - shared);
+    len += nameLen - shared;
+  }
+  nt->data = realloc(nt->data, len+1);
+}
+
+//frees everything held by a name table
+void freeNameTable(nameTable *nt)
+{
+  free(nt->data);
+  free(nt->heads);
+  nt->data = NULL;
+  nt->heads = NULL;
+  nt->size = 0;
+}
+
+//decodes the names of block b one after the other into out, stopping after
+//the name with id last or, if name is not NULL, at the first name that is
+//not less than name
+//returns the id of the name left in out
+int nameTableScan(nameTable *nt, int b, int last, const char *name, char *out)
+{
+  const unsigned char *p = nt->data + nt->heads[b];
+  int id = b*NAMEBLOCK;
+  int end = (id+NAMEBLOCK < nt->size) ? id+NAMEBLOCK : nt->size;
+  for(;id<end;id++)
+  {
+    long long shared = (id % NAMEBLOCK == 0) ? 0 : getVarint(&p);
+    long long rest = getVarint(&p);
+    memcpy(out + shared, p, rest);
+    out[shared + rest] = '\0';
+    p += rest;
+    if(id == last || (name != NULL && strcmp(out, name) >= 0)) break;
+  }
+  return id;
+}
+
+//copies the name with the given id into out
+void nameTableGet(nameTable *nt, int id, char *out)
+{
+  nameTableScan(nt, id/NAMEBLOCK, id, NULL, out);
+}
+
+//returns the id of the first name in the name table that is not less than
+//name, which is left in out, or the size of the table if there is none. the
+//block is found by binary search over the block heads, which are stored in
+//full, and then decoded up to the name
+int nameTableSeek(nameTable *nt, const char *name, char *out)
+{
+  if(nt->size == 0) return 0;
+  int low = 0, high = (nt->size+NAMEBLOCK-1)/NAMEBLOCK - 1;
+  while(low < high) //find the last block whose head is not greater than name
+  {
+    int mid = (low + high + 1)/2;
+    const unsigned char *p = nt->data + nt->heads[mid];
+    long long len = getVarint(&p);
+    if(strncmp((const char*)p, name, len) <= 0) low = mid;
+    else high = mid-1;
+  }
+
+  int id = nameTableScan(nt, low, -1, name, out);
+  //every name of the block is less than name: the next head is the first
+  if(id == (low+1)*NAMEBLOCK && id < nt->size) nameTableGet(nt, id, out);
+  return id;
+}
+
+//returns the id of name in the name table, or -1 if it is not there
+int nameTableFind(nameTable *nt, const char *name)
+{
+  char temp[MAXLEN];
+  int id = nameTableSeek(nt, name, temp);
+  return (id < nt->size && strcmp(temp, name) == 0) ? id : -1;
+}
+
+//entry of a member index, see memberIndex
+typedef struct indexEntry_t
+{
+  long long offset;
+  long long size;
+  int name; //id of the member name without trailing slashes
+  char kind;
+  bool dir; //the member name has a trailing slash
+} indexEntry;
+
+//compact counterpart of a member table for tables that are kept in memory
+//for a long time: the members in archive order with their names in a
+//front-coded name table, along with the last member of each name
+typedef struct memberIndex_t
+{
+  nameTable names;
+  indexEntry *entries;
+  int *latest;
+  int size;
+} memberIndex;
+
+//initializes a new, empty member index
+void indexInit(memberIndex *ix)
+{
+  memset(ix, 0, sizeof(memberIndex));
+}
+
+//frees everything held by a member index, leaving it empty
+void freeIndex(memberIndex *ix)
+{
+  freeNameTable(&ix->names);
+  free(ix->entries);
+  free(ix->latest);
+  indexInit(ix);
+}
+
+//qsort comparison of two strings
+int compareNames(const void *a, const void *b)
+{
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+//builds a member index holding the members of table t. the names of t are
+//stripped of their trailing slashes in the process
+void indexBuild(memberIndex *ix, memberTable *t)
+{
+  ix->size = t->size;
+  ix->entries = malloc((t->size+1)*sizeof(indexEntry));
+  char **sorted = malloc((t->size+1)*sizeof(char*));
+  for(int i=0;i<t->size;i++)
+  {
+    char *name = t->members[i].name;
+    ix->entries[i].dir = name[0] != '\0' && name[strlen(name)-1] == '/';
+    removeTrailingSlashes(name);
+    sorted[i] = name;
+  }
+  qsort(sorted, t->size, sizeof(char*), compareNames);
+  int n = 0;
+  for(int i=0;i<t->size;i++)
+    if(n == 0 || strcmp(sorted[n-1], sorted[i]) != 0) sorted[n++] = sorted[i];
+  nameTableBuild(&ix->names, sorted, n);
+
+  ix->latest = malloc((n+1)*sizeof(int));
+  for(int i=0;i<n;i++) ix->latest[i] = -1;
+  for(int i=0;i<t->size;i++)
+  {
+    member *m = &t->members[i];
+    indexEntry *e = &ix->entries[i];
+    char **found = bsearch(&m->name, sorted, n, sizeof(char*), compareNames);
+    e->name = found - sorted;
+    e->offset = m->offset;
+    e->size = m->size;
+    e->kind = m->kind;
+    ix->latest[e->name] = i;
+  }
+  free(sorted);
+}
+
+//(dev, ino) of a regular file that has been stored in full, and the member
+//name it was stored under
+typedef struct inodeEntry_t
+{
+  dev_t dev;
+  ino_t ino;
+  char *name;
+} inodeEntry;
+
+//open-addressing hash table of inodeEntry, used to find files with several
+//hard links that were already archived
+typedef struct inodeTable_t
+{
+  inodeEntry *entries;
+  int size;
+  int capacity;
+} inodeTable;
+
+//initializes a new inode table
+void inodeTableInit(inodeTable *t)
+{
+  t->entries = NULL;
+  t->size = 0;
+  t->capacity = 0;
+}
+
+//returns the slot for (dev, ino) in table t, which is either the matching
+//entry or the empty slot where it belongs
+inodeEntry *inodeSlot(inodeTable *t, dev_t dev, ino_t ino)
+{
+  unsigned long long h =
+    ((unsigned long long)ino * 0x9E3779B97F4A7C15ULL) ^ dev;
+  int i = h & (t->capacity-1);
+  while(t->entries[i].name != NULL &&
+        (t->entries[i].dev != dev || t->entries[i].ino != ino))
+    i = (i+1) & (t->capacity-1);
+  return &t->entries[i];
+}
+
+//returns the member name stored for (dev, ino), or NULL if there is none
+const char *inodeTableFind(inodeTable *t, dev_t dev, ino_t ino)
+{
+  if(t->size == 0) return NULL;
+  return inodeSlot(t, dev, ino)->name;
+}
+
+//records that (dev, ino) was stored under the member name
+void inodeTableAdd(inodeTable *t, dev_t dev, ino_t ino, const char *name)
+{
+  if(2*(t->size+1) > t->capacity) //keep the table at most half full
+  {
+    inodeTable bigger;
+    bigger.capacity = (t->capacity == 0) ? 64 : 2*t->capacity;
+    bigger.size = t->size;
+    bigger.entries = calloc(bigger.capacity, sizeof(inodeEntry));
+    for(int i=0;i<t->capacity;i++)
+      if(t->entries[i].name != NULL)
+        *inodeSlot(&bigger, t->entries[i].dev, t->entries[i].ino) =
+          t->entries[i];
+    free(t->entries);
+    *t = bigger;
+  }
+  inodeEntry *e = inodeSlot(t, dev, ino);
+  if(e->name != NULL) return;
+  e->dev = dev;
+  e->ino = ino;
+  e->name = malloc(strlen(name)+1);
+  strcpy(e->name, name);
+  t->size++;
+}
+
+//frees all entries in the table, leaving the table empty
+void freeInodeTable(inodeTable *t)
+{
+  for(int i=0;i<t->capacity;i++) free(t->entries[i].name);
+  free(t->entries);
+  inodeTableInit(t);
+}
+
+//pattern excluding paths from a walk, classified when it is compiled so that
+//most checks are a plain comparison: kind is '=' for a literal, '<' for a
+//literal followed by *, '>' for * followed by a literal (text holds the
+//literal in all three) and '*' for any other pattern, matched with fnmatch.
+//a pattern holding a slash is matched against the whole path, any other
+//against the last component of the path
+typedef struct excludePattern_t
+{
+  char *text;
+  int len;
+  char kind;
+  bool path;
+} excludePattern;
+
+//compiled exclude patterns of a pass
+typedef struct excludeList_t
+{
+  excludePattern *patterns;
+  int size;
+} excludeList;
+
+//compiles the n patterns into x. trailing slashes are ignored
+void excludeCompile(excludeList *x, char **patterns, int n)
+{
+  x->patterns = malloc((n+1)*sizeof(excludePattern));
+  x->size = 0;
+  for(int i=0;i<n;i++)
+  {
+    char *text = strdup(patterns[i]);
+    if(strcmp(text, "/") != 0) removeTrailingSlashes(text);
+    int len = strlen(text);
+    if(len == 0)
+    {
+      free(text);
+      continue;
+    }
+    excludePattern *p = &x->patterns[x->size++];
+    p->path = strchr(text, '/') != NULL;
+    int special = strcspn(text, "*?[\\");
+    if(special == len) p->kind = '=';
+    else if(special == len-1 && text[len-1] == '*') p->kind = '<';
+    else if(special == 0 && text[0] == '*' &&
+            strcspn(text+1, "*?[\\") == (size_t)(len-1)) p->kind = '>';
+    else p->kind = '*';
+    if(p->kind == '<') text[--len] = '\0';
+    if(p->kind == '>') memmove(text, text+1, len--);
+    p->text = text;
+    p->len = len;
+  }
+}
+
+//frees everything held by compiled exclude patterns
+void freeExcludes(excludeList *x)
+{
+  for(int i=0;i<x->size;i++) free(x->patterns[i].text);
+  free(x->patterns);
+  x->patterns = NULL;
+  x->size = 0;
+}
+
+//returns whether path is matched by one of the exclude patterns
+bool isExcluded(const excludeList *x, const char *path)
+{
+  if(x->size == 0) return false;
+  const char *base = strrchr(path, '/');
+  base = (base == NULL || base[1] == '\0') ? path : base+1;
+  int pathLen = strlen(path), baseLen = strlen(base);
+  for(int i=0;i<x->size;i++)
+  {
+    const excludePattern *p = &x->patterns[i];
+    const char *s = p->path ? path : base;
+    int len = p->path ? pathLen : baseLen;
+    bool match;
+    if(p->kind == '=') match = len == p->len && memcmp(s, p->text, len) == 0;
+    else if(p->kind == '<')
+      match = len >= p->len && memcmp(s, p->text, p->len) == 0;
+    else if(p->kind == '>')
+      match = len >= p->len && memcmp(s+len-p->len, p->text, p->len) == 0;
+    else match = fnmatch(p->text, s, p->path ? FNM_PATHNAME : 0) == 0;
+    if(match) return true;
+  }
+  return false;
+}
+
+//entry of a directory listing
+//name is the entry name within the directory, and regular tells whether it
+//may be a regular file. when sorted for reading, entries whose first data
+//block could be located (placed == true) are ordered by its physical
+//position on disk, and come before the others, which are ordered by inode
+typedef struct dirEntry_t
+{
+  char *name;
+  bool regular;
+  bool placed;
+  unsigned long long key;
+} dirEntry;
+
+//file in the read-ahead queue. state is 'p' while it waits for a reader (len
+//is its size once a reader has looked at it, -1 before), 'r' while a reader
+//reads it, 'd' once data holds its len bytes, and 's' if it is left for the
+//writer to read (not a regular file, larger than the cap, or unreadable)
+typedef struct aheadFile_t
+{
+  char *name;
+  char state;
+  char *data;
+  long long len;
+  struct aheadFile_t *next;
+} aheadFile;
+
+//pool of reader threads that read files into memory ahead of the writer
+//files holds the files the writer has not taken yet, in the order it will
+//take them, and used the bytes held by files being read or read, which
+//never exceeds cap. changed is signalled whenever either changes
+typedef struct readAhead_t
+{
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  aheadFile *files;
+  long long used;
+  long long cap;
+  bool stop;
+  bool nocache;
+  int numThreads;
+  pthread_t *threads;
+} readAhead;
+
+//reads the whole open file fd of len bytes into a new buffer
+//returns the buffer, or NULL if the file could not be read
+char *readWhole(int fd, long long *len)
+{
+  char *data = malloc(*len+1);
+  long long done = 0;
+  while(done < *len)
+  {
+    ssize_t n = read(fd, data+done, *len-done);
+    if(n < 0 && errno == EINTR) continue;
+    if(n < 0)
+    {
+      free(data);
+      return NULL;
+    }
+    if(n == 0) break; //the file shrank
+    done += n;
+  }
+  *len = done;
+  return data;
+}
+
+//thread function of a reader: reads the first waiting file of the queue as
+//soon as it fits in the memory cap, until the pool is stopped
+void *readAheadWorker(void *arg)
+{
+  readAhead *ra = arg;
+  pthread_mutex_lock(&ra->lock);
+  while(!ra->stop)
+  {
+    aheadFile *f = ra->files;
+    while(f != NULL && f->state != 'p') f = f->next;
+    if(f == NULL || (f->len >= 0 && ra->used > 0 && ra->used+f->len > ra->cap))
+    {
+      pthread_cond_wait(&ra->changed, &ra->lock);
+      continue;
+    }
+    f->state = 'r';
+    char *name = strdup(f->name);
+    pthread_mutex_unlock(&ra->lock);
+
+    struct stat buf;
+    int fd = open(name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+    bool regular = fd >= 0 && fstat(fd, &buf) == 0 && S_ISREG(buf.st_mode) &&
+      buf.st_size <= ra->cap;
+    long long len = regular ? buf.st_size : -1;
+    char *data = NULL;
+
+    pthread_mutex_lock(&ra->lock);
+    if(regular && ra->used > 0 && ra->used+len > ra->cap)
+    {
+      f->state = 'p'; //wait for room, letting the writer take it meanwhile
+      f->len = len;
+    }
+    else if(regular)
+    {
+      ra->used += len;
+      pthread_mutex_unlock(&ra->lock);
+      long long got = len;
+      data = readWhole(fd, &got);
+      if(data != NULL && ra->nocache)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+      pthread_mutex_lock(&ra->lock);
+      ra->used -= len - ((data == NULL) ? 0 : got);
+      f->data = data;
+      f->len = got;
+      f->state = (data == NULL) ? 's' : 'd';
+    }
+    else f->state = 's';
+    if(fd >= 0) close(fd);
+    free(name);
+    pthread_cond_broadcast(&ra->changed);
+  }
+  pthread_mutex_unlock(&ra->lock);
+  return NULL;
+}
+
+//starts a pool of readers threads that read files ahead, holding at most
+//cap bytes at a time, and drop them from the page cache if nocache is set
+//returns NULL if no thread could be started
+readAhead *readAheadStart(int readers, long long cap, bool nocache)
+{
+  readAhead *ra = malloc(sizeof(readAhead));
+  pthread_mutex_init(&ra->lock, NULL);
+  pthread_cond_init(&ra->changed, NULL);
+  ra->files = NULL;
+  ra->used = 0;
+  ra->cap = cap;
+  ra->stop = false;
+  ra->nocache = nocache;
+  ra->threads = malloc(readers*sizeof(pthread_t));
+  for(ra->numThreads=0;ra->numThreads<readers;ra->numThreads++)
+    if(pthread_create(&ra->threads[ra->numThreads], NULL, readAheadWorker,
+       ra) != 0) break;
+  if(ra->numThreads > 0) return ra;
+  free(ra->threads);
+  free(ra);
+  return NULL;
+}
+
+//queues the entries of directory dirName that may be regular files to be
+//read ahead. the writer archives them before anything already queued
+void readAheadQueue(readAhead *ra, const char *dirName, dirEntry *entries,
+  int len)
+{
+  pthread_mutex_lock(&ra->lock);
+  aheadFile **tail = &ra->files;
+  for(int i=0;i<len;i++)
+  {
+    if(!entries[i].regular) continue;
+    aheadFile *f = malloc(sizeof(aheadFile));
+    f->name = malloc(strlen(dirName)+strlen(entries[i].name)+2);
+    sprintf(f->name, "%s/%s", dirName, entries[i].name);
+    f->state = 'p';
+    f->data = NULL;
+    f->len = -1;
+    f->next = *tail;
+    *tail = f;
+    tail = &f->next;
+  }
+  pthread_cond_broadcast(&ra->changed);
+  pthread_mutex_unlock(&ra->lock);
+}
+
+//takes the file name out of the queue, waiting for it if a reader is busy
+//with it. if it has been read and data is not NULL, its contents are handed
+//over in *data and *len, and must be given back with readAheadRelease;
+//otherwise they are dropped
+//returns false if the contents were not handed over
+bool readAheadTake(readAhead *ra, const char *name, char **data,
+  long long *len)
+{
+  pthread_mutex_lock(&ra->lock);
+  aheadFile **link = &ra->files;
+  while(*link != NULL && strcmp((*link)->name, name) != 0)
+    link = &(*link)->next;
+  aheadFile *f = *link;
+  while(f != NULL && f->state == 'r')
+    pthread_cond_wait(&ra->changed, &ra->lock);
+  if(f == NULL)
+  {
+    pthread_mutex_unlock(&ra->lock);
+    return false;
+  }
+
+  //the queue may have changed while waiting
+  for(link = &ra->files;*link != f;link = &(*link)->next);
+  *link = f->next;
+  bool taken = (f->state == 'd' && data != NULL);
+  if(taken)
+  {
+    *data = f->data;
+    *len = f->len;
+  }
+  else if(f->state == 'd')
+  {
+    ra->used -= f->len;
+    free(f->data);
+  }
+  pthread_cond_broadcast(&ra->changed);
+  pthread_mutex_unlock(&ra->lock);
+  free(f->name);
+  free(f);
+  return taken;
+}
+
+//gives back the contents of a file handed over by readAheadTake once they
+//have been written
+void readAheadRelease(readAhead *ra, char *data, long long len)
+{
+  free(data);
+  pthread_mutex_lock(&ra->lock);
+  ra->used -= len;
+  pthread_cond_broadcast(&ra->changed);
+  pthread_mutex_unlock(&ra->lock);
+}
+
+//stops the readers of a pool and frees it along with every file still queued
+void readAheadStop(readAhead *ra)
+{
+  pthread_mutex_lock(&ra->lock);
+  ra->stop = true;
+  pthread_cond_broadcast(&ra->changed);
+  pthread_mutex_unlock(&ra->lock);
+  for(int i=0;i<ra->numThreads;i++) pthread_join(ra->threads[i], NULL);
+
+  while(ra->files != NULL)
+  {
+    aheadFile *f = ra->files;
+    ra->files = f->next;
+    free(f->data);
+    free(f->name);
+    free(f);
+  }
+  pthread_mutex_destroy(&ra->lock);
+  pthread_cond_destroy(&ra->changed);
+  free(ra->threads);
+  free(ra);
+}
+
+//token bucket limiting a rate: tokens are added at rate per second up to
+//burst, and spending more than there are leaves a debt that is waited off
+typedef struct tokenBucket_t
+{
+  double rate;
+  double burst;
+  double tokens;
+} tokenBucket;
+
+//initializes a token bucket for rate per second (0 for no limit), starting
+//empty so that a pass does not start with a burst
+void bucketInit(tokenBucket *b, double rate)
+{
+  b->rate = rate;
+  b->burst = rate*THROTTLEBURST;
+  b->tokens = 0;
+}
+
+//refills bucket b for elapsed seconds and spends cost from it
+//returns how many seconds to wait until the debt is paid off
+double bucketSpend(tokenBucket *b, double elapsed, double cost)
+{
+  if(b->rate <= 0) return 0;
+  b->tokens += elapsed*b->rate;
+  if(b->tokens > b->burst) b->tokens = b->burst;
+  b->tokens -= cost;
+  return (b->tokens < 0) ? -b->tokens/b->rate : 0;
+}
+
+//returns the current time in seconds on a clock that is never set back
+double monotonicTime()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec/1e9;
+}
+
+//clocks at the start of a timed step of a pass
+typedef struct statTimer_t
+{
+  double wall;
+  double cpu;
+} statTimer;
+
+//statistics of a pass, kept with the stats option: the wall and cpu time
+//spent in each phase and the calls made in it, the members written from
+//files or to extracted files and those copied between archives, and the
+//clocks and /proc/self/io system call counts at the start of the pass
+typedef struct passStats_t
+{
+  double wall[STATPHASES];
+  double cpu[STATPHASES];
+  long long calls[STATPHASES];
+  long long membersWritten;
+  long long membersCopied;
+  statTimer start;
+  long long readCalls;
+  long long writeCalls;
+} passStats;
+
+//returns the cpu time in seconds on clock (CLOCK_THREAD_CPUTIME_ID for the
+//calling thread, CLOCK_PROCESS_CPUTIME_ID for the whole process)
+double cpuTime(clockid_t clock)
+{
+  struct timespec now;
+  clock_gettime(clock, &now);
+  return now.tv_sec + now.tv_nsec/1e9;
+}
+
+//reads the read and write system call counts of the process from
+///proc/self/io, leaving them at -1 if it cannot be read
+void systemCalls(long long *reads, long long *writes)
+{
+  *reads = *writes = -1;
+  FILE *io = fopen("/proc/self/io", "r");
+  if(io == NULL) return;
+  char line[128];
+  while(fgets(line, sizeof(line), io) != NULL)
+    if(sscanf(line, "syscr: %lld", reads) != 1)
+      sscanf(line, "syscw: %lld", writes);
+  fclose(io);
+}
+
+//state shared by the functions taking part in one pass over an archive
+//opts holds the command line options, archive the existing archive open for
+//reading, inPlace whether new members are appended to that archive rather
+//than to a rewritten copy, links the files with several hard links stored in
+//full by this pass, seen every member read so far from the existing archive,
+//and dropped the names of plain members that were not carried over into the
+//new archive. unreadable holds the names of the files r could not open, whose
+//members are carried over as they are
+//the remaining fields control the page cache: archiveFd is a descriptor for
+//plain reads of the existing archive, newArchiveFd one on the archive being
+//written (-1 if none), moved counts the bytes copied, trimmed is the value of
+//moved when the cache was last trimmed, flushed is how much of the new
+//archive has been handed to writeback, and the rest is the cache report
+//ahead is the pool reading files ahead of fileToArchive (NULL if none), and
+//exclude the compiled exclude patterns of the options
+//bytes and ops throttle the copies of the pass (see options), which have
+//made ops reads and writes so far; throttleTime is when the buckets were
+//last refilled, startTime when the pass started and throttled the time
+//spent waiting on them
+//stats holds the statistics of the pass if the stats option is set
+//growFd is a descriptor on the archive being written used to preallocate it
+//(-1 until it is first grown, -2 if it cannot be preallocated) and grownTo
+//the end of its preallocated space
+//checkpoint is the checkpoint file of a pass writing a new archive (NULL if
+//the pass is not checkpointed), checkpointFd a descriptor on the new archive
+//used to commit it, checkpointTime when it was last committed and nextMember
+//the position in the existing archive of the first member not yet finished
+//with. resumed holds the members written by the interrupted pass a resumed
+//pass continues (empty otherwise)
+//syncFds holds a descriptor on a file extracted by the pass for each of the
+//syncDevs file systems it extracted files to, numSyncFs of them, which batch
+//durability syncs every SYNCINTERVAL seconds, last at syncTime. syncDirs
+//holds the directories given new entries that strict durability syncs when
+//the pass ends
+struct context_t
+{
+  const options *opts;
+  FILE *archive;
+  bool inPlace;
+  inodeTable links;
+  memberTable seen;
+  stack dropped;
+  stack unreadable;
+
+  int archiveFd;
+  int newArchiveFd;
+  long long moved;
+  long long trimmed;
+  long long flushed;
+  long long residentAtStart;
+  long long residentPeak;
+  long long cachedAtStart;
+
+  readAhead *ahead;
+  excludeList exclude;
+
+  tokenBucket bytes;
+  tokenBucket ops;
+  long long opsDone;
+  double throttleTime;
+  double startTime;
+  double throttled;
+
+  passStats stats;
+
+  int growFd;
+  long long grownTo;
+
+  FILE *checkpoint;
+  int checkpointFd;
+  double checkpointTime;
+  long long nextMember;
+  memberIndex resumed;
+
+  int *syncFds;
+  dev_t *syncDevs;
+  int numSyncFs;
+  double syncTime;
+  stack syncDirs;
+};
+
+//returns the number of bytes of the open file fd held in the page cache
+long long residentBytes(int fd)
+{
+  struct stat buf;
+  if(fd < 0 || fstat(fd, &buf) != 0) return 0;
+
+  long long page = sysconf(_SC_PAGESIZE);
+  long long window = 1LL<<30, total = 0;
+  unsigned char *vec = malloc(window/page);
+  for(long long offset=0;offset<buf.st_size;offset+=window)
+  {
+    long long len = (buf.st_size-offset < window) ? buf.st_size-offset : window;
+    void *map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, offset);
+    if(map == MAP_FAILED) break;
+    if(mincore(map, len, vec) == 0)
+      for(long long i=0;i<(len+page-1)/page;i++) total += vec[i] & 1;
+    munmap(map, len);
+  }
+  free(vec);
+  return total*page;
+}
+
+//returns the size of the system page cache in kilobytes, from /proc/meminfo
+long long systemCacheKB()
+{
+  FILE *meminfo = fopen("/proc/meminfo", "r");
+  if(meminfo == NULL) return 0;
+  char line[256];
+  long long kb = 0;
+  while(fgets(line, sizeof(line), meminfo) != NULL)
+    if(sscanf(line, "Cached: %lld", &kb) == 1) break;
+  fclose(meminfo);
+  return kb;
+}
+
+//initializes a new context for a pass over the open archive, read with plain
+//reads through the descriptor archiveFd (-1 if there is no archive)
+void contextInit(context *ctx, const options *opts, FILE *archive,
+  int archiveFd)
+{
+  ctx->opts = opts;
+  ctx->archive = archive;
+  ctx->inPlace = false;
+  inodeTableInit(&ctx->links);
+  tableInit(&ctx->seen);
+  stackInit(&ctx->dropped);
+  stackInit(&ctx->unreadable);
+
+  ctx->archiveFd = archiveFd;
+  ctx->newArchiveFd = -1;
+  ctx->ahead = NULL;
+  excludeCompile(&ctx->exclude, opts->exclude, opts->excludeLen);
+  ctx->checkpoint = NULL;
+  ctx->checkpointFd = -1;
+  ctx->checkpointTime = ctx->nextMember = 0;
+  bucketInit(&ctx->bytes, opts->throttleBytes);
+  bucketInit(&ctx->ops, opts->throttleOps);
+  ctx->opsDone = 0;
+  ctx->startTime = ctx->throttleTime = monotonicTime();
+  ctx->throttled = 0;
+  memset(&ctx->stats, 0, sizeof(passStats));
+  ctx->growFd = opts->preallocate ? -1 : -2;
+  ctx->grownTo = 0;
+  ctx->syncFds = NULL;
+  ctx->syncDevs = NULL;
+  ctx->numSyncFs = 0;
+  ctx->syncTime = monotonicTime();
+  stackInit(&ctx->syncDirs);
+  if(opts->stats)
+  {
+    ctx->stats.start.wall = monotonicTime();
+    ctx->stats.start.cpu = cpuTime(CLOCK_PROCESS_CPUTIME_ID);
+    systemCalls(&ctx->stats.readCalls, &ctx->stats.writeCalls);
+  }
+  indexInit(&ctx->resumed);
+  ctx->moved = ctx->trimmed = ctx->flushed = 0;
+  ctx->residentAtStart = ctx->residentPeak = 0;
+  if(opts->cacheReport)
+  {
+    ctx->residentAtStart = ctx->residentPeak = residentBytes(ctx->archiveFd);
+    ctx->cachedAtStart = systemCacheKB();
+  }
+  if(opts->nocache && ctx->archiveFd >= 0)
+    posix_fadvise(ctx->archiveFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+}
+
+//frees everything held by a context
+void freeContext(context *ctx)
+{
+  freeInodeTable(&ctx->links);
+  freeTable(&ctx->seen);
+  freeStack(&ctx->dropped);
+  freeStack(&ctx->unreadable);
+  if(ctx->newArchiveFd >= 0) close(ctx->newArchiveFd);
+  if(ctx->ahead != NULL) readAheadStop(ctx->ahead);
+  freeExcludes(&ctx->exclude);
+  if(ctx->checkpoint != NULL) fclose(ctx->checkpoint);
+  if(ctx->checkpointFd >= 0) close(ctx->checkpointFd);
+  freeIndex(&ctx->resumed);
+  //free the space preallocated past the end of the archive written
+  struct stat buf;
+  if(ctx->growFd >= 0 && fstat(ctx->growFd, &buf) == 0)
+    if(ftruncate(ctx->growFd, buf.st_size) != 0)
+      fprintf(stderr, "Could not free preallocated space\n");
+  if(ctx->growFd >= 0) close(ctx->growFd);
+  for(int i=0;i<ctx->numSyncFs;i++) close(ctx->syncFds[i]);
+  free(ctx->syncFds);
+  free(ctx->syncDevs);
+  freeStack(&ctx->syncDirs);
+}
+
+//drops the pages of the pass that are no longer needed from the page cache:
+//the existing archive behind the read position, and the part of the new
+//archive that was handed to writeback at the previous trim. the new archive
+//written since then is handed to writeback in turn
+void trimCache(context *ctx)
+{
+  if(ctx->archiveFd >= 0 && !ctx->inPlace)
+    posix_fadvise(ctx->archiveFd, 0, ftello(ctx->archive),
+      POSIX_FADV_DONTNEED);
+  if(ctx->newArchiveFd >= 0)
+  {
+    long long end = lseek(ctx->newArchiveFd, 0, SEEK_END);
+    sync_file_range(ctx->newArchiveFd, 0, ctx->flushed,
+      SYNC_FILE_RANGE_WAIT_BEFORE);
+    posix_fadvise(ctx->newArchiveFd, 0, ctx->flushed, POSIX_FADV_DONTNEED);
+    sync_file_range(ctx->newArchiveFd, ctx->flushed, end - ctx->flushed,
+      SYNC_FILE_RANGE_WRITE);
+    ctx->flushed = end;
+  }
+}
+
+//waits as long as the throttle of the pass asks for after a copy of bytes
+//bytes taking ops reads and writes. the wait is taken after every copy, so
+//that the rate is kept smoothly rather than in bursts of a second
+void throttle(context *ctx, long long bytes, int ops)
+{
+  ctx->opsDone += ops;
+  if(ctx->bytes.rate <= 0 && ctx->ops.rate <= 0) return;
+  double now = monotonicTime();
+  double elapsed = now - ctx->throttleTime;
+  double wait = bucketSpend(&ctx->bytes, elapsed, bytes);
+  double opsWait = bucketSpend(&ctx->ops, elapsed, ops);
+  if(opsWait > wait) wait = opsWait;
+  ctx->throttleTime = now;
+  if(wait <= 0) return;
+
+  struct timespec pause = {(time_t)wait, (long)((wait - (time_t)wait)*1e9)};
+  nanosleep(&pause, NULL);
+  ctx->throttled += wait;
+}
+
+//prints the rates achieved by the pass on stderr
+void reportRates(context *ctx)
+{
+  double elapsed = monotonicTime() - ctx->startTime;
+  if(elapsed <= 0) elapsed = 1e-9;
+  fprintf(stderr, "throttle: %lld bytes and %lld reads and writes in %.2f s "
+    "(%.2f MB/s, %.0f ops/s), %.2f s spent waiting\n", ctx->moved,
+    ctx->opsDone, elapsed, ctx->moved/elapsed/(1<<20), ctx->opsDone/elapsed,
+    ctx->throttled);
+}
+
+//starts timing a step of the pass, if the stats option is set
+void statsStart(context *ctx, statTimer *t)
+{
+  if(ctx == NULL || !ctx->opts->stats) return;
+  t->wall = monotonicTime();
+  t->cpu = cpuTime(CLOCK_THREAD_CPUTIME_ID);
+}
+
+//adds the time since statsStart and calls calls to phase of the pass, if
+//the stats option is set
+void statsStop(context *ctx, int phase, statTimer *t, long long calls)
+{
+  if(ctx == NULL || !ctx->opts->stats) return;
+  ctx->stats.wall[phase] += monotonicTime() - t->wall;
+  ctx->stats.cpu[phase] += cpuTime(CLOCK_THREAD_CPUTIME_ID) - t->cpu;
+  ctx->stats.calls[phase] += calls;
+}
+
+//preallocates len bytes of a file from offset, leaving its size as it is,
+//so that the file system can lay them out in as few extents as possible
+//returns false if the file system does not support it
+bool preallocate(int fd, long long offset, long long len)
+{
+  return len <= 0 || fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, len) == 0;
+}
+
+//makes sure the archive being written has room preallocated for size more
+//bytes past its end, growing it PREALLOCSTEP bytes at a time, so that it is
+//made of large extents however small its members are. what is left over is
+//freed at the end of the pass by freeContext
+void growArchive(const char *archiveName, long long size, context *ctx)
+{
+  if(ctx->growFd == -2) return;
+  if(ctx->growFd < 0 && (ctx->growFd = open(archiveName, O_WRONLY)) < 0)
+  {
+    ctx->growFd = -2;
+    return;
+  }
+  long long end = lseek(ctx->growFd, 0, SEEK_END);
+  if(end < 0 || end + size <= ctx->grownTo) return;
+  long long len = (size > PREALLOCSTEP) ? size : PREALLOCSTEP;
+  if(!preallocate(ctx->growFd, end, len))
+  {
+    close(ctx->growFd);
+    ctx->growFd = -2;
+    return;
+  }
+  ctx->grownTo = end + len;
+}
+
+//opens the archive being written for appending a member of about size
+//bytes, timed as writing
+FILE *appendArchive(const char *archiveName, long long size, context *ctx)
+{
+  statTimer timer;
+  statsStart(ctx, &timer);
+  growArchive(archiveName, size, ctx);
+  FILE *archive = fopen(archiveName, "a");
+  statsStop(ctx, STATWRITE, &timer, 1);
+  return archive;
+}
+
+//closes a file written by the pass, which writes out what it buffered,
+//timed as writing
+void closeWritten(FILE *file, context *ctx)
+{
+  statTimer timer;
+  statsStart(ctx, &timer);
+  fclose(file);
+  statsStop(ctx, STATWRITE, &timer, 1);
+}
+
+//remembers that the directory holding path got a new entry, so that a pass
+//with strict durability syncs it when it ends
+void syncDirectoryLater(context *ctx, const char *path)
+{
+  if(ctx == NULL || ctx->opts->durability != DURABLESTRICT) return;
+  char dirName[strlen(path)+2];
+  strcpy(dirName, path);
+  if(strcmp(dirName, "/") != 0) removeTrailingSlashes(dirName);
+  char *slash = strrchr(dirName, '/');
+  if(slash == NULL) strcpy(dirName, ".");
+  else if(slash == dirName) strcpy(dirName, "/");
+  else *slash = '\0';
+  if(!isNameInStack(&ctx->syncDirs, dirName))
+    stackPush(&ctx->syncDirs, dirName);
+}
+
+//remembers the file system holding the open file fd, so that a pass with
+//batch durability syncs it
+void syncFileSystemLater(context *ctx, int fd)
+{
+  struct stat buf;
+  if(fstat(fd, &buf) != 0) return;
+  for(int i=0;i<ctx->numSyncFs;i++)
+    if(ctx->syncDevs[i] == buf.st_dev) return;
+  int syncFd = dup(fd);
+  if(syncFd < 0) return;
+  ctx->syncFds = realloc(ctx->syncFds, (ctx->numSyncFs+1)*sizeof(int));
+  ctx->syncDevs = realloc(ctx->syncDevs, (ctx->numSyncFs+1)*sizeof(dev_t));
+  ctx->syncFds[ctx->numSyncFs] = syncFd;
+  ctx->syncDevs[ctx->numSyncFs++] = buf.st_dev;
+}
+
+//makes a file extracted by the pass durable as the durability option asks,
+//before it is closed: strict syncs the file and remembers its directory,
+//batch syncs every file system that files were extracted to every
+//SYNCINTERVAL seconds
+void syncExtracted(FILE *file, const char *name, context *ctx)
+{
+  if(ctx == NULL || ctx->opts->durability == DURABLENONE) return;
+  statTimer timer;
+  statsStart(ctx, &timer);
+  fflush(file);
+  if(ctx->opts->durability == DURABLESTRICT)
+  {
+    if(fsync(fileno(file)) != 0) fprintf(stderr, "Could not sync %s\n", name);
+    syncDirectoryLater(ctx, name);
+  }
+  else
+  {
+    syncFileSystemLater(ctx, fileno(file));
+    if(monotonicTime() - ctx->syncTime >= SYNCINTERVAL)
+    {
+      for(int i=0;i<ctx->numSyncFs;i++) syncfs(ctx->syncFds[i]);
+      ctx->syncTime = monotonicTime();
+    }
+  }
+  statsStop(ctx, STATWRITE, &timer, 1);
+}
+
+//completes the syncs of the files extracted by a pass: batch syncs their
+//file systems once more, strict syncs the directories given new entries
+void finishSync(context *ctx)
+{
+  statTimer timer;
+  statsStart(ctx, &timer);
+  for(int i=0;i<ctx->numSyncFs;i++) syncfs(ctx->syncFds[i]);
+  for(node *n=ctx->syncDirs.head;n!=NULL;n=n->next)
+  {
+    int fd = open(n->name, O_RDONLY | O_DIRECTORY);
+    if(fd < 0 || fsync(fd) != 0)
+      fprintf(stderr, "Could not sync directory %s\n", n->name);
+    if(fd >= 0) close(fd);
+  }
+  statsStop(ctx, STATWRITE, &timer, 0);
+}
+
+//takes the file name from the read-ahead pool as readAheadTake does, timing
+//the wait for it as reading
+bool readAheadTimed(context *ctx, const char *name, char **data,
+  long long *len)
+{
+  statTimer timer;
+  statsStart(ctx, &timer);
+  bool taken = readAheadTake(ctx->ahead, name, data, len);
+  statsStop(ctx, STATREAD, &timer, 1);
+  return taken;
+}
+
+//prints the statistics of a pass in mode as JSON on stderr. names is the
+//stack of names given to the pass and found the names it found, whose
+//searches are counted with those of the dropped and unreadable names
+void reportStats(context *ctx, char mode, stack *names, stack *found)
+{
+  const char *phases[STATPHASES] = {"walk", "stat", "read", "write", "match"};
+  passStats *st = &ctx->stats;
+  long long reads, writes;
+  systemCalls(&reads, &writes);
+  long long compares = ctx->dropped.compares + ctx->unreadable.compares;
+  if(names != NULL) compares += names->compares;
+  if(found != NULL) compares += found->compares;
+
+  fprintf(stderr, "{\"mode\": \"%c\", \"wall_seconds\": %.6f, "
+    "\"cpu_seconds\": %.6f, \"phases\": {", mode,
+    monotonicTime() - st->start.wall,
+    cpuTime(CLOCK_PROCESS_CPUTIME_ID) - st->start.cpu);
+  for(int i=0;i<STATPHASES;i++)
+    fprintf(stderr, "%s\"%s\": {\"wall_seconds\": %.6f, "
+      "\"cpu_seconds\": %.6f, \"calls\": %lld}", (i == 0) ? "" : ", ",
+      phases[i], st->wall[i], st->cpu[i], st->calls[i]);
+  fprintf(stderr, "}, \"bytes_moved\": %lld, \"members_read\": %d, "
+    "\"members_written\": %lld, \"members_copied\": %lld, "
+    "\"read_syscalls\": %lld, "
+    "\"write_syscalls\": %lld, \"name_comparisons\": %lld}\n",
+    ctx->moved, ctx->seen.size, st->membersWritten,
+    st->membersCopied, (reads < 0) ? -1 : reads - st->readCalls,
+    (writes < 0) ? -1 : writes - st->writeCalls, compares);
+}
+
+//records that n bytes were copied by the pass with one read and one write,
+//throttling the pass, and trimming the page cache and sampling the cache
+//footprint every so often when those options are set
+void ioProgress(context *ctx, long long n)
+{
+  if(ctx == NULL) return;
+  ctx->moved += n;
+  throttle(ctx, n, 2);
+  if(ctx->moved - ctx->trimmed < CACHESTEP) return;
+
+  bool sample = ctx->opts->cacheReport &&
+    ctx->moved/CACHESAMPLE != ctx->trimmed/CACHESAMPLE;
+  ctx->trimmed = ctx->moved;
+  if(ctx->opts->nocache) trimCache(ctx);
+  if(sample)
+  {
+    long long resident = residentBytes(ctx->archiveFd);
+    if(resident > ctx->residentPeak) ctx->residentPeak = resident;
+  }
+}
+
+//drops a file that the pass has finished reading or writing from the page
+//cache when the nocache option is set. written pages are handed to writeback
+//first, since only clean pages can be dropped
+void dropFromCache(FILE *file, bool written, context *ctx)
+{
+  if(ctx == NULL || !ctx->opts->nocache) return;
+  if(written)
+  {
+    fflush(file);
+    sync_file_range(fileno(file), 0, 0, SYNC_FILE_RANGE_WRITE);
+  }
+  posix_fadvise(fileno(file), 0, 0, POSIX_FADV_DONTNEED);
+}
+
+//prints the cache footprint of a pass on stderr
+void reportCache(context *ctx)
+{
+  long long resident = residentBytes(ctx->archiveFd);
+  if(resident > ctx->residentPeak) ctx->residentPeak = resident;
+  fprintf(stderr, "cache: archive %lld KB resident at start, %lld KB peak, "
+    "%lld KB at end", ctx->residentAtStart/1024, ctx->residentPeak/1024,
+    resident/1024);
+  if(ctx->newArchiveFd >= 0)
+    fprintf(stderr, "; new archive %lld KB resident",
+      residentBytes(ctx->newArchiveFd)/1024);
+  fprintf(stderr, "; system page cache %+lld KB\n",
+    systemCacheKB() - ctx->cachedAtStart);
+}
+
+//copies len bytes from in to out, or everything up to the end of in if len
+//is negative, in blocks of COPYBUF bytes. the progress is reported to ctx,
+//which is NULL for copies made outside of a pass
+//returns false if in ends early
+bool copyBytes(FILE *in, FILE *out, long long len, context *ctx)
+{
+  char buf[COPYBUF];
+  while(len != 0)
+  {
+    size_t want = (len < 0 || len > COPYBUF) ? COPYBUF : len;
+    statTimer timer;
+    statsStart(ctx, &timer);
+    size_t n = fread(buf, 1, want, in);
+    statsStop(ctx, STATREAD, &timer, 1);
+    statsStart(ctx, &timer);
+    fwrite(buf, 1, n, out);
+    statsStop(ctx, STATWRITE, &timer, 1);
+    ioProgress(ctx, n);
+    if(n < want) return len < 0;
+    if(len > 0) len -= n;
+  }
+  return true;
+}
+
+//state behind a stream reading a file with O_DIRECT: the descriptor, an
+//aligned buffer holding bufLen bytes of the file from offset bufStart, and
+//the read position
+typedef struct directStream_t
+{
+  int fd;
+  char *buf;
+  long long bufStart;
+  long long bufLen;
+  long long pos;
+} directStream;
+
+//fopencookie read function of an O_DIRECT stream
+ssize_t directStreamRead(void *cookie, char *out, size_t len)
+{
+  directStream *ds = cookie;
+  if(ds->pos < ds->bufStart || ds->pos >= ds->bufStart + ds->bufLen)
+  {
+    ds->bufStart = ds->pos - ds->pos % DIRECTALIGN;
+    ssize_t n = pread(ds->fd, ds->buf, DIRECTBUF, ds->bufStart);
+    if(n < 0) return -1;
+    ds->bufLen = n;
+    if(ds->pos >= ds->bufStart + ds->bufLen) return 0; //end of file
+  }
+  long long avail = ds->bufStart + ds->bufLen - ds->pos;
+  if((long long)len > avail) len = avail;
+  memcpy(out, ds->buf + (ds->pos - ds->bufStart), len);
+  ds->pos += len;
+  return len;
+}
+
+//fopencookie seek function of an O_DIRECT stream
+int directStreamSeek(void *cookie, off64_t *offset, int whence)
+{
+  directStream *ds = cookie;
+  struct stat buf;
+  long long pos = *offset;
+  if(whence == SEEK_CUR) pos += ds->pos;
+  else if(whence == SEEK_END)
+  {
+    if(fstat(ds->fd, &buf) != 0) return -1;
+    pos += buf.st_size;
+  }
+  if(pos < 0) return -1;
+  ds->pos = pos;
+  *offset = pos;
+  return 0;
+}
+
+//fopencookie close function of an O_DIRECT stream
+int directStreamClose(void *cookie)
+{
+  directStream *ds = cookie;
+  close(ds->fd);
+  free(ds->buf);
+  free(ds);
+  return 0;
+}
+
+//opens a file for sequential reading with O_DIRECT, bypassing the page cache
+//returns NULL if the file cannot be opened that way (e.g. on tmpfs)
+FILE *openDirect(const char *name)
+{
+  directStream *ds = malloc(sizeof(directStream));
+  ds->fd = open(name, O_RDONLY | O_DIRECT);
+  ds->buf = NULL;
+  ds->bufStart = ds->bufLen = ds->pos = 0;
+  if(ds->fd < 0 || posix_memalign((void**)&ds->buf, DIRECTALIGN, DIRECTBUF))
+  {
+    if(ds->fd >= 0) close(ds->fd);
+    free(ds);
+    return NULL;
+  }
+
+  //O_DIRECT is accepted by open on some file systems that reject the reads
+  if(pread(ds->fd, ds->buf, DIRECTALIGN, 0) < 0)
+  {
+    directStreamClose(ds);
+    return NULL;
+  }
+  cookie_io_functions_t io =
+    {directStreamRead, NULL, directStreamSeek, directStreamClose};
+  FILE *stream = fopencookie(ds, "r", io);
+  if(stream == NULL) directStreamClose(ds);
+  return stream;
+}
+
+
+//reads the part of a member header that follows the name line: an optional
+//mtime attribute (-1 is stored in mtime if there is none), an optional kind
+//mark, the data size and the '|' delimiter
+//returns false if the header is corrupted
+bool readMemberHeader(FILE *archive, char *kind, long long *size,
+  long long *mtime)
+{
+  int c;
+  while(isspace(c = getc(archive)));
+  *mtime = -1;
+  if(c == TIMEMARK)
+  {
+    if(fscanf(archive, "%lld", mtime) != 1 || *mtime < 0 ||
+       getc(archive) != ' ') return false;
+    c = getc(archive);
+  }
+  if(c == LINKMARK || c == DELTAMARK) *kind = c;
+  else
+  {
+    ungetc(c, archive);
+    *kind = '\0';
+  }
+  if(fscanf(archive, "%lld", size) != 1 || *size < 0) return false;
+  return getc(archive) == '|';
+}
+
+//returns the number of spaces to put between the name line and the rest of
+//a member header starting at offset pos so that the data of the member
+//starts at a multiple of align. only plain members holding data are aligned
+//(align 0 leaves every member unaligned); readMemberHeader skips the spaces
+long long headerPadding(long long pos, const char *name, char kind,
+  long long size, long long mtime, long long align)
+{
+  if(align <= 0 || kind != '\0' || size == 0) return 0;
+  char digits[64];
+  long long end = pos + strlen(name) + 1 + sprintf(digits, "%lld|", size);
+  if(mtime >= 0) end += sprintf(digits, "%c%lld ", TIMEMARK, mtime);
+  return (align - end % align) % align;
+}
+
+//writes the header of a member to the archive, padded so that the data
+//starts at a multiple of align (see headerPadding). the mtime of the file is
+//recorded in the header unless it is negative
+void writeMemberHeader(FILE *archive, const char *name, char kind,
+  long long size, long long mtime, long long align)
+{
+  long long pad = 0;
+  if(align > 0 && fseeko(archive, 0, SEEK_END) == 0)
+    pad = headerPadding(ftello(archive), name, kind, size, mtime, align);
+  fprintf(archive, "%s\n", name);
+  while(pad-- > 0) putc(' ', archive);
+  if(mtime >= 0) fprintf(archive, "%c%lld ", TIMEMARK, mtime);
+  if(kind != '\0') putc(kind, archive);
+  fprintf(archive, "%lld|", size);
+}
+
+//returns the mtime of a file in nanoseconds, to be recorded in its member
+//header if the times option is set, or -1 otherwise
+long long fileTime(const struct stat *buf, const options *opts)
+{
+  if(!opts->times) return -1;
+  return buf->st_mtim.tv_sec*1000000000LL + buf->st_mtim.tv_nsec;
+}
+
+//reads the data of a link member, which is the name of the member it links
+//to, into target
+//returns false if the link is corrupted
+bool readLinkTarget(FILE *archive, long long size, char *target)
+{
+  if(size == 0 || size >= MAXLEN) return false;
+  if(fread(target, 1, size, archive) != (size_t)size) return false;
+  target[size] = '\0';
+  return strchr(target, '\n') == NULL;
+}
+
+//returns the index of the member holding the data for member i, following
+//links to the plain or delta member they were stored against, or -1 if there
+//is none
+int resolveLink(FILE *archive, memberTable *t, int i)
+{
+  if(t->members[i].kind != LINKMARK) return i;
+
+  char target[MAXLEN];
+  long long pos = ftello(archive);
+  fseeko(archive, t->members[i].offset, SEEK_SET);
+  bool ok = readLinkTarget(archive, t->members[i].size, target);
+  fseeko(archive, pos, SEEK_SET);
+  if(!ok) return -1;
+
+  for(int j=i-1;j>=0;j--)
+    if(strcmp(t->members[j].name, target) == 0)
+      return (t->members[j].kind != LINKMARK) ? j : -1;
+  return -1;
+}
+
+//returns the index of the plain member that the delta member i was computed
+//against, which is the last plain member with the same name before it, or
+//-1 if there is none
+int findBase(memberTable *t, int i)
+{
+  for(int j=i-1;j>=0;j--)
+    if(t->members[j].kind == '\0' &&
+       strcmp(t->members[j].name, t->members[i].name) == 0) return j;
+  return -1;
+}
+
+//adds up the bytes, headers included, of the live and dead members of the
+//archive whose member table is t. a member is live if it is the latest of
+//its name or holds the data of a live link or delta
+void measureLiveness(FILE *archive, memberTable *t, long long *liveBytes,
+  long long *deadBytes)
+{
+  bool *live = calloc(t->size+1, sizeof(bool));
+  memberIndex ix;
+  indexInit(&ix);
+  indexBuild(&ix, t);
+  for(int n=0;n<ix.names.size;n++)
+  {
+    int i = ix.latest[n];
+    live[i] = true;
+    int j = resolveLink(archive, t, i);
+    if(j >= 0) live[j] = true;
+    if(j >= 0 && t->members[j].kind == DELTAMARK && findBase(t, j) >= 0)
+      live[findBase(t, j)] = true;
+  }
+  *liveBytes = *deadBytes = 0;
+  for(int i=0;i<t->size;i++)
+  {
+    long long start = (i == 0) ? 0 : t->members[i-1].offset +
+      t->members[i-1].size;
+    long long len = t->members[i].offset + t->members[i].size - start;
+    if(live[i]) *liveBytes += len;
+    else *deadBytes += len;
+  }
+  free(live);
+  freeIndex(&ix);
+}
+
+//returns the length of the file stored by member m, which for a delta member
+//is the length recorded at the start of its data, or -1 if it is corrupted
+long long memberLength(FILE *archive, member *m)
+{
+  if(m->kind != DELTAMARK) return m->size;
+
+  long long len;
+  long long pos = ftello(archive);
+  fseeko(archive, m->offset, SEEK_SET);
+  if(fscanf(archive, "%lld", &len) != 1) len = -1;
+  fseeko(archive, pos, SEEK_SET);
+  return len;
+}
+
+//clips a range of a file of fileLen bytes given by offset and len, as in
+//options, to the file: a negative offset counts back from the end and a
+//negative len reaches to the end. offset is made absolute
+void clipRange(long long fileLen, long long *offset, long long *len)
+{
+  if(*offset < 0) *offset = (-*offset > fileLen) ? 0 : fileLen + *offset;
+  if(*offset > fileLen) *offset = fileLen;
+  if(*len < 0 || *len > fileLen - *offset) *len = fileLen - *offset;
+}
+
+//rebuilds len bytes from offset from of the file stored by a delta member
+//onto out (everything from there on if len is negative). the archive must be
+//positioned at the start of the delta's data, which is the length of the
+//file on one line followed by instructions that either copy a range of the
+//base member ("Coffset len\n") or insert literal bytes ("Ilen\n" + bytes).
+//instructions outside of the range are checked but their data is not read
+//returns false if the delta is corrupted
+//takes as parameters the archive, the base member, the size of the delta's
+//data, the range, the output file, and the context of the pass (NULL outside
+//of one)
+bool applyDeltaRange(FILE *archive, member *base, long long size,
+  long long from, long long len, FILE *out, context *ctx)
+{
+  int archiveFd = (ctx == NULL) ? fileno(archive) : ctx->archiveFd;
+  long long end = ftello(archive) + size;
+  long long targetLen, written = 0;
+  if(fscanf(archive, "%lld", &targetLen) != 1 || getc(archive) != '\n')
+    return false;
+  long long to = (len < 0) ? targetLen : from + len;
+
+  char buf[BUFSIZ];
+  while(ftello(archive) < end)
+  {
+    int type = getc(archive);
+    long long offset = 0, n;
+    if(type == 'C' && (fscanf(archive, "%lld %lld", &offset, &n) != 2 ||
+       getc(archive) != '\n')) return false;
+    if(type == 'I' && (fscanf(archive, "%lld", &n) != 1 ||
+       getc(archive) != '\n')) return false;
+    if((type != 'C' && type != 'I') || offset < 0 || n < 0) return false;
+    if(type == 'C' && offset + n > base->size) return false;
+
+    //the part of this instruction's output that falls in the range
+    long long first = (from > written) ? from - written : 0;
+    long long last = (to < written + n) ? to - written : n;
+    if(type == 'C')
+      for(long long done=first;done<last;)
+      {
+        ssize_t got = pread(archiveFd, buf,
+          (last-done < BUFSIZ) ? last-done : BUFSIZ, base->offset+offset+done);
+        if(got <= 0) return false;
+        fwrite(buf, 1, got, out);
+        ioProgress(ctx, got);
+        done += got;
+      }
+    else if(first < last)
+    {
+      fseeko(archive, first, SEEK_CUR);
+      if(!copyBytes(archive, out, last - first, ctx)) return false;
+      fseeko(archive, n - last, SEEK_CUR);
+    }
+    else fseeko(archive, n, SEEK_CUR);
+    written += n;
+  }
+  return ftello(archive) == end && written == targetLen;
+}
+
+//rebuilds the whole file stored by a delta member onto out, see
+//applyDeltaRange
+//returns false if the delta is corrupted
+bool applyDelta(FILE *archive, member *base, long long size, FILE *out,
+  context *ctx)
+{
+  return applyDeltaRange(archive, base, size, 0, -1, out, ctx);
+}
+
+//reads the member headers of an archive into table t, seeking over the
+//member data instead of reading it, up to the member starting at end (to the
+//end of the archive if end is negative)
+//returns false if the archive is corrupted
+bool scanArchiveTo(FILE *archive, memberTable *t, long long end)
+{
+  struct stat buf;
+  if(fstat(fileno(archive), &buf) != 0) return false;
+  if(end < 0) end = buf.st_size;
+
+  char name[MAXLEN];
+  int nameIndex = 0;
+  int c;
+  while( (nameIndex > 0 || ftello(archive) < end) &&
+         (c = getc(archive)) != EOF)
+  {
+    if(c != '\n')
+    {
+      if(nameIndex == MAXLEN-1) return false;
+      name[nameIndex++] = c;
+      continue;
+    }
+    name[nameIndex] = '\0';
+    nameIndex = 0;
+
+    char kind;
+    long long size, mtime;
+    if(!readMemberHeader(archive, &kind, &size, &mtime)) return false;
+    long long offset = ftello(archive);
+    if(offset + size > buf.st_size) return false;
+    tablePush(t, name, kind, offset, size, mtime);
+    fseeko(archive, size, SEEK_CUR);
+  }
+  return nameIndex == 0 && ftello(archive) <= end;
+}
+
+//reads the member headers of a whole archive into table t
+//returns false if the archive is corrupted
+bool scanArchive(FILE *archive, memberTable *t)
+{
+  return scanArchiveTo(archive, t, -1);
+}
+
+//returns true, and says why, if the times option must not add members to
+//the archive whose member table is t: it has files and none of them records
+//a time (directories never do), so a Far that does not know the attribute
+//can still read it, and the first member with one would make it unreadable
+//to that Far
+bool timesRefused(memberTable *t, const char *archiveName)
+{
+  bool files = false;
+  for(int i=0;i<t->size;i++)
+  {
+    if(t->members[i].mtime >= 0) return false;
+    files = files || t->members[i].name[strlen(t->members[i].name)-1] != '/';
+  }
+  if(!files) return false;
+  fprintf(stderr, "Archive %s records no times: adding members with times "
+    "would make it unreadable to a Far without them\n", archiveName);
+  return true;
+}
+
+//Bloom filter over the member names of an archive, kept in its index so
+//that names that are not in the archive can be turned away without reading
+//it. every member name is added along with the directories above it, since
+//a name given on the command line selects everything under it
+//bits holds size bits (NULL if there is no filter), each name sets hashes of
+//them, and names is the number of distinct names added so far
+typedef struct bloomFilter_t
+{
+  unsigned char *bits;
+  long long size;
+  int hashes;
+  long long names;
+} bloomFilter;
+
+//sets up an empty filter with room for twice the given number of names, so
+//that members appended later can be added to it
+void bloomInit(bloomFilter *f, long long names)
+{
+  long long room = (2*names > BLOOMMIN) ? 2*names : BLOOMMIN;
+  f->size = (room*BLOOMBITS + 63)/64*64;
+  f->bits = calloc(f->size/8, 1);
+  f->hashes = BLOOMHASHES;
+  f->names = 0;
+}
+
+//frees the bits of a filter, leaving its size so that it is known that the
+//archive had one
+void freeBloom(bloomFilter *f)
+{
+  free(f->bits);
+  f->bits = NULL;
+}
+
+//returns true if every bit of the first len characters of name is set in
+//the filter, setting them if set is true. the bits are found by double
+//hashing the two halves of a 64 bit FNV-1a hash
+bool bloomProbe(bloomFilter *f, const char *name, int len, bool set)
+{
+  unsigned long long hash = 14695981039346656037ULL;
+  for(int i=0;i<len;i++)
+    hash = (hash ^ (unsigned char)name[i]) * 1099511628211ULL;
+  unsigned long long a = hash & 0xffffffff, b = (hash >> 32) | 1;
+  bool all = true;
+  for(int i=0;i<f->hashes;i++)
+  {
+    unsigned long long bit = (a + i*b) % f->size;
+    all = all && (f->bits[bit/8] & (1 << bit%8));
+    if(set) f->bits[bit/8] |= 1 << bit%8;
+  }
+  return all;
+}
+
+//adds a member name to the filter, and every directory above it
+void bloomAddMember(bloomFilter *f, const char *memberName)
+{
+  char name[strlen(memberName)+1];
+  strcpy(name, memberName);
+  if(strcmp(name, "/") != 0) removeTrailingSlashes(name);
+  for(int i=1;name[i-1] != '\0';i++)
+    if((name[i] == '/' || name[i] == '\0') && !bloomProbe(f, name, i, true))
+      f->names++;
+}
+
+//returns false if the name (without trailing slashes) is certainly not in
+//the archive or under a directory in it, true if it may be. an archive
+//without a filter may hold any name
+bool bloomMayHave(bloomFilter *f, const char *name)
+{
+  return f->bits == NULL || bloomProbe(f, name, strlen(name), false);
+}
+
+//index kept next to an archive in ARCHIVE.idx once concurrent access to it
+//or a filter of its member names has been asked for, recording which archive
+//file (by inode) holds the committed members, how long they are and,
+//optionally, a Bloom filter of their names. readers take a shared lock on
+//byte PUBLISHLOCK of it while they open the archive and read the index, and
+//read no further than the committed length afterwards; the writer holds an
+//exclusive lock on byte WRITERLOCK for its whole pass, and takes an
+//exclusive lock on byte PUBLISHLOCK only to rename a rewritten archive into
+//place and record it. the locks are open file description locks, so they
+//also keep threads of one process apart
+//fd is the open index (-1 if the archive has none), inode and committed
+//are its record (committed is -1 if the index is empty) and filter the
+//filter stored after it (whose size is 0 if there is none)
+typedef struct sidecar_t
+{
+  int fd;
+  long long inode;
+  long long committed;
+  bloomFilter filter;
+} sidecar;
+
+//opens the index of archiveName, creating it if create is set
+//returns false if the archive has no index
+bool sidecarOpen(sidecar *sc, const char *archiveName, bool create)
+{
+  char indexName[strlen(archiveName)+5];
+  sprintf(indexName, "%s.idx", archiveName);
+  sc->fd = open(indexName, O_RDWR | (create ? O_CREAT : 0), 0666);
+  sc->inode = sc->committed = -1;
+  sc->filter = (bloomFilter){NULL, 0, 0, 0};
+  return sc->fd >= 0;
+}
+
+//takes (type F_RDLCK or F_WRLCK) or releases (F_UNLCK) the lock on byte
+//which of an index, waiting for it as long as needed
+void sidecarLock(sidecar *sc, int which, short type)
+{
+  struct flock lock = {.l_type = type, .l_whence = SEEK_SET, .l_start = which,
+    .l_len = 1};
+  while(fcntl(sc->fd, F_OFD_SETLKW, &lock) != 0 && errno == EINTR);
+}
+
+//reads the record of an index and the filter that follows it
+void sidecarRead(sidecar *sc)
+{
+  char record[160];
+  ssize_t len = pread(sc->fd, record, sizeof(record)-1, 0);
+  record[(len < 0) ? 0 : len] = '\0';
+  bloomFilter *f = &sc->filter;
+  freeBloom(f);
+  f->size = 0;
+  int n = sscanf(record, "Far index %lld %lld %lld %d %lld", &sc->inode,
+    &sc->committed, &f->size, &f->hashes, &f->names);
+  if(n < 2) sc->inode = sc->committed = -1;
+  char *end = strchr(record, '\n');
+  if(n != 5 || end == NULL || f->size <= 0 || f->size % 64 != 0 ||
+     f->hashes <= 0)
+  {
+    f->size = 0;
+    return;
+  }
+  f->bits = malloc(f->size/8);
+  if(pread(sc->fd, f->bits, f->size/8, end-record+1) != f->size/8)
+    freeBloom(f);
+}
+
+//returns the length of the committed members of archiveName, which must
+//have been opened under the index lock, or -1 to read all of it: when the
+//index is empty, or when it does not describe the archive (the archive was
+//written by a Far that did not keep its index), which is reported
+long long sidecarCommitted(sidecar *sc, const char *archiveName)
+{
+  sidecarRead(sc);
+  struct stat buf;
+  if(sc->committed < 0 || stat(archiveName, &buf) != 0) return -1;
+  if(buf.st_ino == (ino_t)sc->inode && buf.st_size >= sc->committed)
+    return sc->committed;
+  freeBloom(&sc->filter);
+  fprintf(stderr, "Index of %s is stale, reading the whole archive\n",
+    archiveName);
+  return -1;
+}
+
+//publishes what the writer of an archive wrote: the rewritten archive
+//newArchiveName (NULL if the archive was appended to in place) is renamed
+//over archiveName and the index records the result, both under the
+//exclusive lock, so that a reader sees either the old members or all of
+//the new ones
+void sidecarPublish(sidecar *sc, const char *archiveName,
+  const char *newArchiveName)
+{
+  sidecarLock(sc, PUBLISHLOCK, F_WRLCK);
+  if(newArchiveName != NULL) rename(newArchiveName, archiveName);
+  struct stat buf;
+  if(stat(archiveName, &buf) == 0)
+  {
+    bloomFilter *f = &sc->filter;
+    char record[160];
+    int len = sprintf(record, "Far index %lld %lld",
+      (long long)buf.st_ino, (long long)buf.st_size);
+    if(f->bits != NULL)
+      len += sprintf(record+len, " %lld %d %lld", f->size, f->hashes,
+        f->names);
+    record[len++] = '\n';
+    long long filterLen = (f->bits != NULL) ? f->size/8 : 0;
+    if(pwrite(sc->fd, record, len, 0) != len ||
+       pwrite(sc->fd, f->bits, filterLen, len) != filterLen ||
+       ftruncate(sc->fd, len+filterLen) != 0)
+      fprintf(stderr, "Could not update the index of %s\n", archiveName);
+  }
+  sidecarLock(sc, PUBLISHLOCK, F_UNLCK);
+}
+
+//brings the filter of an index up to date before it is published, if one
+//is wanted or the index had one: the names of the members in added are
+//added to it if it is valid and has room for them, otherwise it is rebuilt
+//from the member headers of the archive file fileName
+void sidecarFilter(sidecar *sc, const char *fileName, memberTable *added,
+  bool wanted)
+{
+  bloomFilter *f = &sc->filter;
+  if(!wanted && f->size == 0) return;
+  if(f->bits != NULL && added != NULL &&
+     (f->names + added->size)*BLOOMBITS <= f->size)
+  {
+    for(int i=0;i<added->size;i++) bloomAddMember(f, added->members[i].name);
+    return;
+  }
+
+  freeBloom(f);
+  f->size = 0;
+  FILE *archive = fopen(fileName, "r");
+  if(archive == NULL) return;
+  memberTable t;
+  tableInit(&t);
+  if(scanArchive(archive, &t))
+  {
+    bloomInit(f, t.size);
+    for(int i=0;i<t.size;i++) bloomAddMember(f, t.members[i].name);
+  }
+  freeTable(&t);
+  fclose(archive);
+}
+
+//closes an index, releasing its locks and freeing its filter
+void sidecarClose(sidecar *sc)
+{
+  if(sc->fd >= 0) close(sc->fd);
+  sc->fd = -1;
+  freeBloom(&sc->filter);
+}
+
+//flushes the data of an archive written by a pass to disk before the pass
+//publishes it, unless the durability option is none, so that a crash cannot
+//leave the archive renamed into place (or appended members published)
+//without their data
+void syncArchive(const char *fileName, const options *opts)
+{
+  if(opts->durability == DURABLENONE) return;
+  int fd = open(fileName, O_RDONLY);
+  if(fd < 0 || fdatasync(fd) != 0)
+    fprintf(stderr, "Could not sync %s\n", fileName);
+  if(fd >= 0) close(fd);
+}
+
+//syncs the directory holding an archive after a pass published it, and the
+//index of the archive (sc may be NULL), unless the durability option is none
+void syncPublished(const char *archiveName, sidecar *sc, const options *opts)
+{
+  if(opts->durability == DURABLENONE) return;
+  char dirName[strlen(archiveName)+2];
+  strcpy(dirName, archiveName);
+  char *slash = strrchr(dirName, '/');
+  if(slash == NULL) strcpy(dirName, ".");
+  else slash[1] = '\0';
+  int fd = open(dirName, O_RDONLY | O_DIRECTORY);
+  if(fd < 0 || fsync(fd) != 0)
+    fprintf(stderr, "Could not sync directory %s\n", dirName);
+  if(fd >= 0) close(fd);
+  if(sc != NULL && sc->fd >= 0 && fdatasync(sc->fd) != 0)
+    fprintf(stderr, "Could not sync the index of %s\n", archiveName);
+}
+
+//opens archiveName for reading a consistent snapshot of it: if it has an
+//index, the archive is opened under the shared lock and *committed is set
+//to the length of its committed members, otherwise *committed is -1. the
+//index is left open in sc, holding its filter, and must be closed
+//returns NULL if the archive cannot be opened
+FILE *openIndexed(const char *archiveName, sidecar *sc, long long *committed)
+{
+  *committed = -1;
+  if(!sidecarOpen(sc, archiveName, false)) return fopen(archiveName, "r");
+  sidecarLock(sc, PUBLISHLOCK, F_RDLCK);
+  FILE *archive = fopen(archiveName, "r");
+  if(archive != NULL) *committed = sidecarCommitted(sc, archiveName);
+  sidecarLock(sc, PUBLISHLOCK, F_UNLCK);
+  return archive;
+}
+
+//opens a consistent snapshot of archiveName for reading, see openIndexed
+//returns NULL if the archive cannot be opened
+FILE *openSnapshot(const char *archiveName, long long *committed)
+{
+  sidecar sc;
+  FILE *archive = openIndexed(archiveName, &sc, committed);
+  sidecarClose(&sc);
+  return archive;
+}
+
+//one instruction of a delta: copy len bytes starting at offset in the base
+//('C'), or insert the len bytes starting at offset in the new file ('I')
+typedef struct deltaOp_t
+{
+  char type;
+  long long offset;
+  long long len;
+} deltaOp;
+
+//growable array of delta instructions
+typedef struct deltaOps_t
+{
+  deltaOp *ops;
+  int size;
+  int capacity;
+} deltaOps;
+
+//appends an instruction to d, merging it into the last one when it
+//continues it
+//returns false if there is no memory for it
+bool deltaPush(deltaOps *d, char type, long long offset, long long len)
+{
+  if(len == 0) return true;
+  deltaOp *last = (d->size > 0) ? &d->ops[d->size-1] : NULL;
+  if(last != NULL && last->type == type && last->offset+last->len == offset)
+  {
+    last->len += len;
+    return true;
+  }
+  if(d->size == d->capacity)
+  {
+    if(d->capacity > INT_MAX/2) return false;
+    int capacity = (d->capacity == 0) ? 64 : 2*d->capacity;
+    deltaOp *ops = realloc(d->ops, capacity*sizeof(deltaOp));
+    if(ops == NULL) return false;
+    d->ops = ops;
+    d->capacity = capacity;
+  }
+  d->ops[d->size].type = type;
+  d->ops[d->size].offset = offset;
+  d->ops[d->size].len = len;
+  d->size++;
+  return true;
+}
+
+//returns the rsync weak checksum of len bytes: the low 16 bits hold the sum
+//of the bytes and the high 16 bits the sum of the running sums
+unsigned int weakChecksum(const unsigned char *buf, long long len)
+{
+  unsigned int a = 0, b = 0;
+  for(long long i=0;i<len;i++)
+  {
+    a += buf[i];
+    b += (len-i)*buf[i];
+  }
+  return (a & 0xffff) | (b << 16);
+}
+
+//computes the instructions rebuilding target from base into d, rsync-style.
+//every whole block of the base is indexed by its weak checksum; the target
+//is scanned with a rolling checksum, candidate blocks are confirmed with
+//memcmp, and everything between matched blocks becomes a literal insert
+//returns false if the base has more than DELTABLOCKS blocks or there is no
+//memory for the delta, in which case the file is better stored in full
+bool computeDelta(const unsigned char *base, long long baseLen,
+  const unsigned char *target, long long targetLen, deltaOps *d)
+{
+  long long blockLen = 1024;
+  while(blockLen*blockLen < baseLen && blockLen < (1<<17)) blockLen *= 2;
+  long long numBlocks = baseLen / blockLen;
+  if(numBlocks > DELTABLOCKS) return false;
+  if(numBlocks <= 0 || targetLen < blockLen)
+    return deltaPush(d, 'I', 0, targetLen);
+
+  //chained hash table from checksum to the blocks having it
+  size_t buckets = 1;
+  while(buckets < 2*(size_t)numBlocks) buckets *= 2;
+  long long *head = malloc(buckets*sizeof(long long));
+  long long *next = malloc((size_t)numBlocks*sizeof(long long));
+  unsigned int *sums = malloc((size_t)numBlocks*sizeof(unsigned int));
+  bool ok = head != NULL && next != NULL && sums != NULL;
+  if(!ok)
+  {
+    free(head);
+    free(next);
+    free(sums);
+    return false;
+  }
+  for(size_t i=0;i<buckets;i++) head[i] = -1;
+  for(long long i=numBlocks-1;i>=0;i--)
+  {
+    sums[i] = weakChecksum(base+i*blockLen, blockLen);
+    long long h = (sums[i] * 0x9E3779B1u) & (buckets-1);
+    next[i] = head[h];
+    head[h] = i;
+  }
+
+  long long pos = 0, literal = 0;
+  unsigned int a = 0, b = 0;
+  bool fresh = true; //checksum must be recomputed at pos
+  while(ok && pos + blockLen <= targetLen)
+  {
+    if(fresh)
+    {
+      unsigned int sum = weakChecksum(target+pos, blockLen);
+      a = sum & 0xffff;
+      b = sum >> 16;
+      fresh = false;
+    }
+    unsigned int sum = (a & 0xffff) | (b << 16);
+    long long match = -1;
+    for(long long i=head[(sum * 0x9E3779B1u) & (buckets-1)];i>=0;i=next[i])
+      if(sums[i] == sum &&
+         memcmp(base+i*blockLen, target+pos, blockLen) == 0)
+      {
+        match = i;
+        break;
+      }
+
+    if(match >= 0)
+    {
+      ok = deltaPush(d, 'I', literal, pos-literal) &&
+        deltaPush(d, 'C', match*blockLen, blockLen);
+      pos += blockLen;
+      literal = pos;
+      fresh = true;
+    }
+    else //roll the checksum forward by one byte
+    {
+      if(pos + blockLen < targetLen)
+      {
+        a += target[pos+blockLen] - target[pos];
+        b += a - blockLen*target[pos];
+      }
+      pos++;
+    }
+  }
+  ok = ok && deltaPush(d, 'I', literal, targetLen-literal);
+
+  free(head);
+  free(next);
+  free(sums);
+  return ok;
+}
+
+//returns the size of the data of a delta member holding the instructions d
+//for a new file of length targetLen
+long long encodedDeltaSize(deltaOps *d, long long targetLen)
+{
+  char line[64];
+  long long size = snprintf(line, sizeof(line), "%lld\n", targetLen);
+  for(int i=0;i<d->size;i++)
+  {
+    if(d->ops[i].type == 'C')
+      size += snprintf(line, sizeof(line), "C%lld %lld\n",
+        d->ops[i].offset, d->ops[i].len);
+    else size += snprintf(line, sizeof(line), "I%lld\n", d->ops[i].len) +
+      d->ops[i].len;
+  }
+  return size;
+}
+
+//returns true if the delta member m encodes exactly the instructions d for
+//the new file target, meaning that the file did not change since m was stored
+bool deltaUnchanged(FILE *archive, member *m, deltaOps *d,
+  const unsigned char *target, long long targetLen)
+{
+  if(encodedDeltaSize(d, targetLen) != m->size) return false;
+
+  long long pos = ftello(archive);
+  fseeko(archive, m->offset, SEEK_SET);
+  long long len;
+  bool same = fscanf(archive, "%lld", &len) == 1 && len == targetLen &&
+    getc(archive) == '\n';
+  for(int i=0;same && i<d->size;i++)
+  {
+    deltaOp *op = &d->ops[i];
+    long long offset = 0;
+    same = getc(archive) == op->type;
+    if(same && op->type == 'C')
+      same = fscanf(archive, "%lld %lld", &offset, &len) == 2 &&
+        offset == op->offset;
+    else if(same) same = fscanf(archive, "%lld", &len) == 1;
+    same = same && len == op->len && getc(archive) == '\n';
+    for(long long j=0;same && op->type == 'I' && j<len;j++)
+      same = getc(archive) == target[op->offset+j];
+  }
+  fseeko(archive, pos, SEEK_SET);
+  return same;
+}
+
+//returns true if member i of the member table t, a plain or delta member of
+//the archive, holds exactly the len bytes at data
+bool memberHolds(FILE *archive, memberTable *t, int i,
+  const unsigned char *data, long long len)
+{
+  member *m = &t->members[i];
+  if(m->kind == LINKMARK || memberLength(archive, m) != len) return false;
+  if(len == 0) return true;
+  if(m->kind == DELTAMARK)
+  {
+    int b = findBase(t, i);
+    char *rebuilt = NULL;
+    size_t rebuiltLen = 0;
+    FILE *out = (b < 0) ? NULL : open_memstream(&rebuilt, &rebuiltLen);
+    if(out == NULL) return false;
+    long long pos = ftello(archive);
+    fseeko(archive, m->offset, SEEK_SET);
+    bool rebuiltOk = applyDelta(archive, &t->members[b], m->size, out, NULL);
+    fseeko(archive, pos, SEEK_SET);
+    bool same = fclose(out) == 0 && rebuiltOk &&
+      rebuiltLen == (size_t)len && memcmp(rebuilt, data, len) == 0;
+    free(rebuilt);
+    return same;
+  }
+  long long pageOffset = m->offset % sysconf(_SC_PAGESIZE);
+  unsigned char *map = mmap(NULL, len+pageOffset, PROT_READ, MAP_PRIVATE,
+    fileno(archive), m->offset-pageOffset);
+  if(map == MAP_FAILED) return false;
+  bool same = memcmp(map+pageOffset, data, len) == 0;
+  munmap(map, len+pageOffset);
+  return same;
+}
+
+//returns the index of the member that the latest member called fileName
+//links to, if it is a link and that member still holds the data of the file,
+//or -1 otherwise
+int unchangedLink(const char *fileName, struct stat *buf, context *ctx)
+{
+  int latest = tableFind(&ctx->seen, fileName);
+  if(latest < 0 || ctx->seen.members[latest].kind != LINKMARK) return -1;
+  int linked = resolveLink(ctx->archive, &ctx->seen, latest);
+  if(linked < 0) return -1;
+  if(buf->st_size == 0)
+    return (memberLength(ctx->archive, &ctx->seen.members[linked]) == 0) ?
+      linked : -1;
+
+  int fd = open(fileName, O_RDONLY);
+  if(fd < 0) return -1;
+  unsigned char *data = mmap(NULL, buf->st_size, PROT_READ, MAP_PRIVATE,
+    fd, 0);
+  close(fd);
+  if(data == MAP_FAILED) return -1;
+  bool same = memberHolds(ctx->archive, &ctx->seen, linked, data,
+    buf->st_size);
+  munmap(data, buf->st_size);
+  return same ? linked : -1;
+}
+
+//stores a regular file as a delta against the plain member holding its last
+//full version, if the archive has one and the delta is less than half the
+//size of the file. nothing is stored if the file is unchanged, including a
+//file stored as a link that still holds the data of the member it links to
+//returns true if the file needs no full copy in the archive, and then sets
+//holder to the name of the member that other hard links to the file can be
+//stored as links to
+//takes as parameters the name of the file, its stat buffer, the name of the
+//archive, the holder to set, and the context holding the members of the
+//archive
+bool storeAsDelta(const char *fileName, struct stat *buf,
+  const char *archiveName, const char **holder, context *ctx)
+{
+  int linked = unchangedLink(fileName, buf, ctx);
+  if(linked >= 0)
+  {
+    *holder = ctx->seen.members[linked].name;
+    return true;
+  }
+  int latest = tableFind(&ctx->seen, fileName);
+  if(latest < 0) return false;
+  char kind = ctx->seen.members[latest].kind;
+  int b = (kind == '\0') ? latest : findBase(&ctx->seen, latest);
+  if(b < 0) return false;
+  member *base = &ctx->seen.members[b];
+  *holder = fileName;
+
+  if(buf->st_size == 0 || base->size == 0)
+    return latest == b && buf->st_size == base->size;
+
+  int fd = open(fileName, O_RDONLY);
+  if(fd < 0) return false;
+  unsigned char *target = mmap(NULL, buf->st_size, PROT_READ, MAP_PRIVATE,
+    fd, 0);
+  close(fd);
+  if(target == MAP_FAILED) return false;
+
+  long long pageOffset = base->offset % sysconf(_SC_PAGESIZE);
+  unsigned char *baseMap = mmap(NULL, base->size+pageOffset, PROT_READ,
+    MAP_PRIVATE, fileno(ctx->archive), base->offset-pageOffset);
+  if(baseMap == MAP_FAILED)
+  {
+    munmap(target, buf->st_size);
+    return false;
+  }
+
+  deltaOps d = {NULL, 0, 0};
+  if(!computeDelta(baseMap+pageOffset, base->size, target, buf->st_size, &d))
+  {
+    free(d.ops);
+    munmap(target, buf->st_size);
+    munmap(baseMap, base->size+pageOffset);
+    return false;
+  }
+
+  bool unchanged = (latest == b) ?
+    (buf->st_size == base->size &&
+     memcmp(baseMap+pageOffset, target, buf->st_size) == 0) :
+    kind == DELTAMARK && deltaUnchanged(ctx->archive,
+      &ctx->seen.members[latest], &d, target, buf->st_size);
+  long long size = encodedDeltaSize(&d, buf->st_size);
+  bool stored = unchanged || size < buf->st_size/2;
+  if(stored && !unchanged)
+  {
+    FILE *archive = fopen(archiveName,"a");
+    writeMemberHeader(archive, fileName, DELTAMARK, size,
+      fileTime(buf, ctx->opts), 0);
+    fprintf(archive, "%lld\n", (long long)buf->st_size);
+    for(int i=0;i<d.size;i++)
+    {
+      if(d.ops[i].type == 'C')
+        fprintf(archive, "C%lld %lld\n", d.ops[i].offset, d.ops[i].len);
+      else
+      {
+        fprintf(archive, "I%lld\n", d.ops[i].len);
+        fwrite(target+d.ops[i].offset, 1, d.ops[i].len, archive);
+      }
+    }
+    fclose(archive);
+  }
+
+  free(d.ops);
+  munmap(target, buf->st_size);
+  munmap(baseMap, base->size+pageOffset);
+  return stored;
+}
+
+//free a stack and prints a message indicating the archive is corrupted
+void archiveCorrupted(stack *s)
+{
+  fprintf(stderr, "Archive corrupted. Shutting down.\n");
+  if(s!=NULL)
+  {
+    freeStack(s);
+    free(s);
+  }
+}
+
+//creates a temporary archive file if the mode is replace or delete
+//takes as parameters the name of the new archive, the name of the existing
+//archive, and the mode
+void createTemporaryArchiveFileIfNecessary(char *newArchiveName,
+  const char* archiveName, char mode)
+{
+  strcpy(newArchiveName, archiveName);
+  strcat(newArchiveName, ".bak");
+
+  if(mode == 'r' || mode == 'd')
+  {
+    FILE* newArchive = fopen(newArchiveName,"w");
+    fclose(newArchive);
+  }
+}
+
+//the identity of a checkpointed pass: the size and modification time of the
+//existing archive and a hash of the names given on the command line, so that
+//a checkpoint is only resumed by the same command on the same archive
+void checkpointIdentity(const char *archiveName, stack *nameStack, char *out)
+{
+  struct stat buf;
+  if(stat(archiveName, &buf) != 0) memset(&buf, 0, sizeof(buf));
+  unsigned long long hash = 14695981039346656037ULL; //FNV-1a
+  for(node *n=(nameStack == NULL) ? NULL : nameStack->head;n!=NULL;n=n->next)
+    for(const char *p=n->name;;p++)
+    {
+      hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+      if(*p == '\0') break;
+    }
+  sprintf(out, "Far checkpoint %lld %lld %ld %llx\n", (long long)buf.st_size,
+    (long long)buf.st_mtim.tv_sec, buf.st_mtim.tv_nsec, hash);
+}
+
+//makes everything written to the new archive so far durable and records its
+//length, with the position in the existing archive the pass continues from,
+//in the checkpoint
+void commitCheckpoint(context *ctx)
+{
+  fdatasync(ctx->checkpointFd);
+  long long len = lseek(ctx->checkpointFd, 0, SEEK_END);
+  fprintf(ctx->checkpoint, "C %lld %lld\n", len, ctx->nextMember);
+  fflush(ctx->checkpoint);
+  fdatasync(fileno(ctx->checkpoint));
+  ctx->checkpointTime = monotonicTime();
+}
+
+//commits a checkpoint if the pass is checkpointed and the last one is at
+//least opts->checkpoint seconds old. called only between members, when the
+//new archive holds nothing but whole members
+void checkpointIfDue(context *ctx)
+{
+  if(ctx->checkpoint == NULL) return;
+  if(monotonicTime() - ctx->checkpointTime < ctx->opts->checkpoint) return;
+  commitCheckpoint(ctx);
+}
+
+//records that the plain member name of the existing archive is not carried
+//over into the new archive
+void dropMember(context *ctx, const char *name)
+{
+  stackPush(&ctx->dropped, name);
+  if(ctx->checkpoint != NULL) fprintf(ctx->checkpoint, "D %s\n", name);
+}
+
+//reads the last committed state from the checkpoint of an interrupted pass
+//(the length of the new archive, the position in the existing archive and
+//the members dropped before it), and restores it: the new archive is cut
+//back to its committed length and its members are indexed in ctx->resumed,
+//the members of the existing archive before the position are put in
+//ctx->seen, and the existing archive is positioned there
+//returns false if there is no checkpoint of the same pass to resume, leaving
+//ctx as it was
+bool resumeCheckpoint(context *ctx, const char *checkpointName,
+  const char *identity, const char *archiveName, const char *newArchiveName)
+{
+  FILE *checkpoint = fopen(checkpointName, "r");
+  if(checkpoint == NULL) return false;
+
+  char line[MAXLEN+3];
+  long long newLen = -1, position = -1;
+  stack dropped, pending;
+  stackInit(&dropped);
+  stackInit(&pending);
+  if(fgets(line, sizeof(line), checkpoint) != NULL &&
+     strcmp(line, identity) == 0)
+    while(fgets(line, sizeof(line), checkpoint) != NULL)
+    {
+      char *end = strchr(line, '\n');
+      if(end == NULL) break; //cut off by the interruption
+      *end = '\0';
+      if(line[0] == 'D' && line[1] == ' ') stackPush(&pending, line+2);
+      else if(sscanf(line, "C %lld %lld", &newLen, &position) == 2)
+      {
+        //drops are only kept once a commit follows them
+        for(node *n=pending.head;n!=NULL;n=n->next)
+          stackPush(&dropped, n->name);
+        freeStack(&pending);
+      }
+    }
+  fclose(checkpoint);
+  freeStack(&pending);
+
+  struct stat buf;
+  memberTable written, seen;
+  tableInit(&written);
+  tableInit(&seen);
+  bool resumed = newLen >= 0 && stat(newArchiveName, &buf) == 0 &&
+    buf.st_size >= newLen && truncate(newArchiveName, newLen) == 0;
+  if(resumed)
+  {
+    FILE *newArchive = fopen(newArchiveName, "r");
+    FILE *archive = fopen(archiveName, "r");
+    resumed = newArchive != NULL && archive != NULL &&
+      scanArchive(newArchive, &written) &&
+      scanArchiveTo(archive, &seen, position) && ftello(archive) == position;
+    if(newArchive != NULL) fclose(newArchive);
+    if(archive != NULL) fclose(archive);
+  }
+  if(resumed) resumed = fseeko(ctx->archive, position, SEEK_SET) == 0;
+
+  if(resumed)
+  {
+    indexBuild(&ctx->resumed, &written);
+    freeTable(&ctx->seen);
+    ctx->seen = seen;
+    for(node *n=dropped.head;n!=NULL;n=n->next)
+      stackPush(&ctx->dropped, n->name);
+    ctx->nextMember = position;
+    fprintf(stderr, "Resuming from checkpoint: %lld bytes and %d members "
+      "already archived\n", newLen, written.size);
+  }
+  else freeTable(&seen);
+  freeTable(&written);
+  freeStack(&dropped);
+  return resumed;
+}
+
+//starts checkpointing a pass writing newArchiveName: the checkpoint file is
+//written afresh with the identity of the pass and, for a resumed pass, the
+//state it resumed from, and is then kept open for appending
+void startCheckpoint(context *ctx, const char *checkpointName,
+  const char *identity, const char *newArchiveName)
+{
+  char tempName[strlen(checkpointName)+5];
+  sprintf(tempName, "%s.new", checkpointName);
+  FILE *checkpoint = fopen(tempName, "w");
+  ctx->checkpointFd = open(newArchiveName, O_WRONLY);
+  if(checkpoint == NULL || ctx->checkpointFd < 0)
+  {
+    fprintf(stderr, "Could not create checkpoint %s\n", checkpointName);
+    if(checkpoint != NULL) fclose(checkpoint);
+    return;
+  }
+
+  fputs(identity, checkpoint);
+  for(node *n=ctx->dropped.head;n!=NULL;n=n->next)
+    fprintf(checkpoint, "D %s\n", n->name);
+  ctx->checkpoint = checkpoint;
+  commitCheckpoint(ctx);
+  fclose(checkpoint);
+  rename(tempName, checkpointName);
+  ctx->checkpoint = fopen(checkpointName, "a");
+}
+
+//finds the physical position on disk of the first data block of a file
+//with FIEMAP
+//returns false if the file system does not report it or the file is empty
+bool physicalOffset(const char *fileName, unsigned long long *offset)
+{
+  int fd = open(fileName, O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+  if(fd < 0) return false;
+  char space[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+  struct fiemap *map = (struct fiemap*)space;
+  memset(space, 0, sizeof(space));
+  map->fm_length = FIEMAP_MAX_OFFSET;
+  map->fm_extent_count = 1;
+  bool found = ioctl(fd, FS_IOC_FIEMAP, map) == 0 &&
+    map->fm_mapped_extents == 1 &&
+    !(map->fm_extents[0].fe_flags & FIEMAP_EXTENT_UNKNOWN);
+  if(found) *offset = map->fm_extents[0].fe_physical;
+  close(fd);
+  return found;
+}
+
+//qsort comparison of two directory entries, see dirEntry
+int compareDirEntries(const void *a, const void *b)
+{
+  const dirEntry *x = a, *y = b;
+  if(x->placed != y->placed) return x->placed ? -1 : 1;
+  if(x->key != y->key) return (x->key < y->key) ? -1 : 1;
+  return strcmp(x->name, y->name);
+}
+
+//reads the entries of an open directory other than . and .. and those
+//excluded, in readdir order or, if sorted is set, so that their contents can
+//be read with as little seeking as possible
+//takes as parameters the directory, its name, the exclude patterns, whether
+//to sort, and a place for the number of entries. the names and the array
+//must be freed by the caller
+dirEntry *listDirectory(DIR *dir, const char *dirName,
+  const excludeList *exclude, bool sorted, int *len)
+{
+  int capacity = 16;
+  dirEntry *entries = malloc(capacity*sizeof(dirEntry));
+  *len = 0;
+
+  struct dirent *tempptr;
+  while((tempptr = readdir(dir)))
+  {
+    if(strcmp(tempptr->d_name, ".") == 0 || strcmp(tempptr->d_name, "..") == 0)
+      continue;
+    char fullName[strlen(dirName)+strlen(tempptr->d_name)+2];
+    sprintf(fullName, "%s/%s", dirName, tempptr->d_name);
+    if(isExcluded(exclude, fullName)) continue;
+    if(*len == capacity)
+    {
+      capacity *= 2;
+      entries = realloc(entries, capacity*sizeof(dirEntry));
+    }
+    dirEntry *e = &entries[(*len)++];
+    e->name = strdup(tempptr->d_name);
+    e->key = tempptr->d_ino;
+    e->placed = false;
+    e->regular = tempptr->d_type == DT_REG || tempptr->d_type == DT_UNKNOWN;
+    if(sorted && e->regular) e->placed = physicalOffset(fullName, &e->key);
+  }
+  if(sorted) qsort(entries, *len, sizeof(dirEntry), compareDirEntries);
+  return entries;
+}
+
+//takes input from a file and appends it to a far archive in the proper format
+//recursively adds files and directories to the archive as well
+//takes as parameters the name of the initial file, the name of the archive,
+//the stack of found names, a boolean indicating whether or not a file was
+//successfully written, and the context of the pass.
+//a file sharing its inode with a file already stored by this pass is stored
+//as a link to that member instead of a second copy of its contents. when
+//members are appended to the existing archive itself, directories already in
+//it are not stored again, and with the delta option files already in it are
+//stored as deltas where that pays off. with the inodeOrder option, the
+//entries of a directory are archived in the order of their data on disk
+//rather than in readdir order, and with the readers option the files of a
+//directory are read ahead by a pool of threads while earlier ones are
+//written
+void fileToArchive(const char* fileName, const char* originalName,
+  const char* archiveName, stack *found, stack *nameStack, bool *wroteFile,
+  context *ctx)
+{
+  FILE *archive;
+  char *data; //contents of the file if they were read ahead
+  long long dataLen;
+  int resumed; //member of ctx->resumed holding the file
+  const char *holder; //member that other hard links to the file link to
+  statTimer timer;
+
+  struct stat buf;
+  if(isExcluded(&ctx->exclude, fileName)) return;
+  statsStart(ctx, &timer);
+  bool statFailed = lstat(fileName, &buf) != 0;
+  statsStop(ctx, STATSTAT, &timer, 1);
+  statsStart(ctx, &timer);
+  bool archived = !statFailed && (isNameInStack(found, fileName) ||
+    isNameInStack(&ctx->unreadable, fileName));
+  statsStop(ctx, STATMATCH, &timer, 0);
+
+  if(statFailed)
+  {
+    if(isNameInStack(nameStack, fileName))
+    {
+      fprintf(stderr,
+        "Lstat failed for %s when trying to archive\n", fileName);
+      removeFromStack(nameStack, fileName);
+    }
+  }
+  else if (archived) return;
+  else if (S_ISREG(buf.st_mode) &&
+           (resumed = nameTableFind(&ctx->resumed.names, fileName)) >= 0)
+  {
+    //already archived by the pass this one resumes
+    *wroteFile = true;
+    stackPush(found, fileName);
+    resumed = ctx->resumed.latest[resumed];
+    if(buf.st_nlink > 1 && ctx->resumed.entries[resumed].kind == '\0' &&
+       inodeTableFind(&ctx->links, buf.st_dev, buf.st_ino) == NULL)
+      inodeTableAdd(&ctx->links, buf.st_dev, buf.st_ino, fileName);
+  }
+  else if (S_ISDIR(buf.st_mode))
+  {
+    statsStart(ctx, &timer);
+    DIR *dir = opendir(fileName);
+    statsStop(ctx, STATWALK, &timer, 1);
+    if(dir == NULL)
+      fprintf(stderr,"Failed to open directory %s\n", fileName);
+    else //recurse into directory
+    {
+      if((!ctx->inPlace || tableFind(&ctx->seen, fileName) < 0) &&
+         nameTableFind(&ctx->resumed.names, fileName) < 0)
+      {
+        archive = appendArchive(archiveName, strlen(fileName)+4, ctx);
+        fputs(fileName, archive);
+        fprintf(archive,"/\n0|");
+        closeWritten(archive, ctx);
+        ctx->stats.membersWritten++;
+      }
+
+      stackPush(found, fileName);
+      if(isNameInStack(found, originalName)) *wroteFile = true;
+
+      if(ctx->opts->readers > 0 && ctx->ahead == NULL)
+        ctx->ahead = readAheadStart(ctx->opts->readers,
+          ctx->opts->readAheadBytes, ctx->opts->nocache);
+      if(ctx->opts->inodeOrder || ctx->ahead != NULL)
+      {
+        int len;
+        statsStart(ctx, &timer);
+        dirEntry *entries = listDirectory(dir, fileName, &ctx->exclude,
+          ctx->opts->inodeOrder, &len);
+        closedir(dir);
+        statsStop(ctx, STATWALK, &timer, len+2);
+        for(int i=0;i<len && ctx->resumed.size > 0;i++)
+        {
+          //files already archived are not read ahead
+          char tempName[strlen(entries[i].name)+strlen(fileName)+2];
+          sprintf(tempName, "%s/%s", fileName, entries[i].name);
+          if(nameTableFind(&ctx->resumed.names, tempName) >= 0)
+            entries[i].regular = false;
+        }
+        if(ctx->ahead != NULL)
+          readAheadQueue(ctx->ahead, fileName, entries, len);
+        for(int i=0;i<len;i++)
+        {
+          char tempName[strlen(entries[i].name)+strlen(fileName)+2];
+          sprintf(tempName, "%s/%s", fileName, entries[i].name);
+          stackPush(nameStack, tempName);
+          fileToArchive(tempName, originalName,
+            archiveName, found, nameStack, wroteFile, ctx);
+          //drop the file if it was read ahead but not archived
+          if(ctx->ahead != NULL && entries[i].regular)
+            readAheadTake(ctx->ahead, tempName, NULL, NULL);
+          free(entries[i].name);
+        }
+        free(entries);
+        return;
+      }
+
+      struct dirent *tempptr;
+      for(;;)
+      {
+        statsStart(ctx, &timer);
+        tempptr = readdir(dir);
+        statsStop(ctx, STATWALK, &timer, 1);
+        if(tempptr == NULL) break;
+        char tempName[strlen(tempptr->d_name)+strlen(fileName)+1];
+        strcpy(tempName, fileName);
+        strcat(tempName, "/");
+        strcat(tempName, tempptr->d_name);
+                
+        if((strcmp(tempptr->d_name, ".") != 0) &&
+           (strcmp(tempptr->d_name, "..") != 0) &&
+           !isExcluded(&ctx->exclude, tempName))
+        {
+          stackPush(nameStack, tempName);
+          fileToArchive(tempName, originalName,
+            archiveName, found, nameStack, wroteFile, ctx);
+        }
+      }
+      closedir(dir);
+    }
+  }
+  else if(S_ISREG(buf.st_mode) && buf.st_nlink > 1 &&
+          inodeTableFind(&ctx->links, buf.st_dev, buf.st_ino) != NULL)
+  {
+    //with delta, a link that still holds the file is not stored again
+    const char *target = inodeTableFind(&ctx->links, buf.st_dev, buf.st_ino);
+    if(!ctx->inPlace || !ctx->opts->delta ||
+       unchangedLink(fileName, &buf, ctx) < 0)
+    {
+      archive = appendArchive(archiveName,
+        strlen(fileName)+strlen(target)+24, ctx);
+      writeMemberHeader(archive, fileName, LINKMARK, strlen(target),
+        fileTime(&buf, ctx->opts), 0);
+      fputs(target, archive);
+      closeWritten(archive, ctx);
+      ctx->stats.membersWritten++;
+    }
+    *wroteFile = true;
+    stackPush(found, fileName);
+  }
+  else if(S_ISREG(buf.st_mode) && ctx->inPlace && ctx->opts->delta &&
+          storeAsDelta(fileName, &buf, archiveName, &holder, ctx))
+  {
+    ctx->stats.membersWritten++;
+    *wroteFile = true;
+    stackPush(found, fileName);
+    if(buf.st_nlink > 1)
+      inodeTableAdd(&ctx->links, buf.st_dev, buf.st_ino, holder);
+  }
+  else if(S_ISREG(buf.st_mode) && ctx->ahead != NULL &&
+          readAheadTimed(ctx, fileName, &data, &dataLen))
+  {
+    archive = appendArchive(archiveName,
+      strlen(fileName)+dataLen+ctx->opts->align+24, ctx);
+    writeMemberHeader(archive, fileName, '\0', dataLen,
+      fileTime(&buf, ctx->opts), ctx->opts->align);
+    statsStart(ctx, &timer);
+    fwrite(data, 1, dataLen, archive);
+    statsStop(ctx, STATWRITE, &timer, 1);
+    ioProgress(ctx, dataLen);
+    closeWritten(archive, ctx);
+    ctx->stats.membersWritten++;
+    readAheadRelease(ctx->ahead, data, dataLen);
+    *wroteFile = true;
+    stackPush(found, fileName);
+    if(buf.st_nlink > 1)
+      inodeTableAdd(&ctx->links, buf.st_dev, buf.st_ino, fileName);
+  }
+  else if(S_ISREG(buf.st_mode))
+  {
+    statsStart(ctx, &timer);
+    FILE *file = fopen(fileName,"r");
+    statsStop(ctx, STATREAD, &timer, 1);
+    if(file == NULL)
+    {
+      //not found, so that every member of the name is kept
+      fprintf(stderr,"Could not open file %s\n", fileName);
+      stackPush(&ctx->unreadable, fileName);
+    }
+    else
+    {
+      //the header holds the size of the file once it is open, and exactly
+      //that many bytes are stored: a file that grows while it is copied is
+      //cut, one that shrinks is padded with zeros, so that the archive stays
+      //readable (watch sees the change and archives the file again)
+      fstat(fileno(file), &buf);
+      archive = appendArchive(archiveName,
+        strlen(fileName)+buf.st_size+ctx->opts->align+24, ctx);
+      writeMemberHeader(archive, fileName, '\0', buf.st_size,
+        fileTime(&buf, ctx->opts), ctx->opts->align);
+
+      long long start = ftello(archive);
+      if(!copyBytes(file, archive, buf.st_size, ctx))
+      {
+        fprintf(stderr, "File %s shrank while being archived\n", fileName);
+        for(long long n=ftello(archive)-start;n<buf.st_size;n++)
+          putc('\0', archive);
+      }
+      *wroteFile = true;
+  
+      dropFromCache(file, false, ctx);
+      fclose(file);
+      closeWritten(archive, ctx);
+      ctx->stats.membersWritten++;
+      stackPush(found, fileName);
+      if(buf.st_nlink > 1)
+        inodeTableAdd(&ctx->links, buf.st_dev, buf.st_ino, fileName);
+    }
+  }
+  checkpointIfDue(ctx);
+}
+
+//Returns the strings before and after the first slash of an input string
+//if the first slash is the first character, parse around the second slash
+//Return 0 if found a non-first-char slash and -1 if did not find one
+//takes as an arguments the input string, and on exit stores the before
+//and after strings in the pointers provided when the function is called
+int parseFirstSlash(char* input, char* before, char* after)
+{
+  char *pchr = strchr(input, '/');
+  if(pchr == input) //first character is a slash
+  {
+    pchr = strchr(input+1,'/');
+  }
+  if(pchr == NULL)
+  {
+    before = after = NULL;
+    return -1;
+  }
+  else
+  {
+    strncpy(before, input, (pchr - input));
+    before[pchr-input] = '\0';
+    strcpy(after, pchr+1);
+    return 0;
+  }
+}
+
+//shares the whole blocks among the next len bytes of the archive with the
+//start of the empty file out using FICLONERANGE instead of copying them. this
+//works on file systems with reflinks (XFS, btrfs) when the data is aligned to
+//the block size, as in archives written with the align option. the archive
+//and out are positioned after the shared bytes
+//returns the number of bytes shared, 0 if they have to be copied
+long long cloneBytes(FILE *archive, FILE *out, long long len)
+{
+  struct stat buf;
+  long long offset = ftello(archive);
+  if(fileno(archive) < 0 || fstat(fileno(out), &buf) != 0 ||
+     buf.st_blksize <= 0 || offset % buf.st_blksize != 0) return 0;
+  long long blocks = len - len % buf.st_blksize;
+  struct file_clone_range range = {fileno(archive), offset, blocks, 0};
+  if(blocks == 0 || ioctl(fileno(out), FICLONERANGE, &range) != 0) return 0;
+  fseeko(archive, offset + blocks, SEEK_SET);
+  fseeko(out, blocks, SEEK_SET);
+  return blocks;
+}
+
+//recursive function for extracting files or directories that will
+//create any directories that do not exist along the way
+//returns 0 if no error, -1 if some misc error occurs, and -2 if the 
+//archive is corrupted
+//takes as parameters the archive file, the path prefix and name of the file,
+//which together can form fullName, the length of the file being extracted,
+//the stack of found names, and the context of the pass (NULL outside of one)
+//prefix + '/' + name == fullName
+int extractFileRecurse(FILE* archive, char* prefix, char* name,
+  const char* fullName, long long fileLen, stack *found, context *ctx)
+{
+  int fullNameLen = strlen(fullName);
+  char beforeSlash[fullNameLen+1];
+  char afterSlash[fullNameLen+1];
+
+  bool foundSlash =
+    (parseFirstSlash(name, beforeSlash, afterSlash) == 0) ?
+    true : false;
+
+  if(!foundSlash) //file
+  {
+    //a file with other hard links (such as one linked earlier by this pass
+    //to an older version) is replaced rather than written through
+    statTimer timer;
+    struct stat buf;
+    statsStart(ctx, &timer);
+    if(lstat(fullName, &buf) == 0 && S_ISREG(buf.st_mode) && buf.st_nlink > 1)
+      unlink(fullName);
+    FILE* newFile = fopen(fullName,"w");
+    statsStop(ctx, STATWRITE, &timer, 1);
+    if(newFile == NULL) return -1;
+    else
+    {
+      long long cloned = cloneBytes(archive, newFile, fileLen);
+      if(ctx != NULL && ctx->opts->preallocate)
+        preallocate(fileno(newFile), cloned, fileLen - cloned);
+      if(!copyBytes(archive, newFile, fileLen - cloned, ctx))
+      {
+        fclose(newFile);
+        archiveCorrupted(found);
+        return -2;
+      }
+      syncExtracted(newFile, fullName, ctx);
+      dropFromCache(newFile, true, ctx);
+      closeWritten(newFile, ctx);
+    }
+  }
+  else
+  {
+    if(strlen(beforeSlash) == strlen(name)-1) //directory with no path
+    {
+      DIR *dir = opendir(fullName);
+      if(dir == NULL)
+      {
+        if(mkdir(fullName, STDPERM) != 0) return -1;
+        syncDirectoryLater(ctx, fullName);
+      }
+      else closedir(dir);
+    }
+    else //navigate path
+    {
+      strcat(prefix, beforeSlash);
+      DIR *dir = opendir(prefix);
+
+      if(dir == NULL)
+      {
+        if(mkdir(prefix, STDPERM) != 0) return -1;
+        syncDirectoryLater(ctx, prefix);
+        stackPush(found, prefix);
+        if((dir = opendir(prefix)) == NULL) return -1;
+      }
+      strcat(prefix, "/");
+      name = afterSlash;
+      
+      int j = extractFileRecurse(archive, prefix,
+        name, fullName, fileLen, found, ctx);
+      
+      closedir(dir);
+      if(j == -1) return -1;
+      if(j == -2) return -2;
+    }
+  }
+  return 0;
+}
+
+//Extracts a file or a directory and its contents
+//Returns 0 if there is no error, -1 if some error occurs
+//takes as parameters the archive file, the full name of the file,
+//the stack of found names, the length of the file to be extracted, and the
+//context of the pass (NULL outside of one)
+int extractFile(FILE *archive, const char *fullName, stack *found,
+  long long fileLen, context *ctx)
+{
+  if(isNameInStack(found, fullName)) return 0;
+
+  int nameLen = strlen(fullName)+1;
+  char prefix[nameLen], name[nameLen];
+  strcpy(name, fullName);
+  prefix[0] = '\0';
+  
+  int j = extractFileRecurse(archive, prefix, name, fullName, fileLen, found,
+    ctx);
+  if(j == -1)
+  {
+    fprintf(stderr, "Failed to extract %s\n", fullName);
+    stackPush(found, fullName);
+    fseeko(archive, fileLen, SEEK_CUR);
+  }
+  else if (j == -2) return -1;
+  else stackPush(found, fullName);
+  return 0;
+}
+
+//Extracts a member stored as a delta, rebuilding the file from the base
+//member it was computed against
+//Returns 0 if there is no error, -1 if the archive is corrupted
+//takes as parameters the archive file, positioned at the data of the delta,
+//the full name of the file, the stack of found names, the index of the delta
+//among the members seen so far, and the context holding them
+int extractDelta(FILE *archive, const char *fullName, stack *found, int d,
+  context *ctx)
+{
+  long long size = ctx->seen.members[d].size;
+  int b = findBase(&ctx->seen, d);
+  if(b < 0) return -1;
+
+  //create the path to the file, then fill it in
+  if(extractFile(archive, fullName, found, 0, ctx) != 0) return -1;
+  FILE *newFile = fopen(fullName, "w");
+  if(newFile == NULL)
+  {
+    fseeko(archive, size, SEEK_CUR);
+    return 0;
+  }
+  if(ctx->opts->preallocate)
+    preallocate(fileno(newFile), 0,
+      memberLength(archive, &ctx->seen.members[d]));
+  bool rebuilt = applyDelta(archive, &ctx->seen.members[b], size, newFile,
+    ctx);
+  syncExtracted(newFile, fullName, ctx);
+  dropFromCache(newFile, true, ctx);
+  fclose(newFile);
+  return rebuilt ? 0 : -1;
+}
+
+//Extracts a member stored as a link to an earlier member of the archive.
+//The hard link is recreated with linkat if the earlier member was extracted
+//by this pass, otherwise the data of the earlier member is copied
+//Returns 0 if there is no error, -1 if the archive is corrupted
+//takes as parameters the archive file, the full name of the link, the stack
+//of found names, and the context holding the members seen so far, the last
+//of which is the link itself
+int extractLink(FILE *archive, const char *fullName, stack *found,
+  context *ctx)
+{
+  if(isNameInStack(found, fullName)) return 0;
+
+  int i = resolveLink(archive, &ctx->seen, ctx->seen.size-1);
+  if(i < 0) return -1;
+  member *target = &ctx->seen.members[i];
+
+  struct stat buf;
+  if(isNameInStack(found, target->name) && lstat(target->name, &buf) == 0 &&
+     S_ISREG(buf.st_mode))
+  {
+    //create the path to the link, then replace the empty file with the link
+    if(extractFile(archive, fullName, found, 0, ctx) != 0) return -1;
+    unlink(fullName);
+    if(linkat(AT_FDCWD, target->name, AT_FDCWD, fullName, 0) == 0) return 0;
+    removeFromStack(found, fullName);
+  }
+
+  long long pos = ftello(archive);
+  fseeko(archive, target->offset, SEEK_SET);
+  int j = (target->kind == DELTAMARK) ?
+    extractDelta(archive, fullName, found, i, ctx) :
+    extractFile(archive, fullName, found, target->size, ctx);
+  fseeko(archive, pos, SEEK_SET);
+  return j;
+}
+
+//copies a link member into the new archive. if the member it links to was
+//dropped from the new archive, the link is stored in full instead with the
+//data of the dropped member
+//returns false if the archive is corrupted
+//takes as parameters the archive file, the new archive file, the name of the
+//link, the size of its data and the context holding the members seen so far,
+//the last of which is the link itself
+bool copyLink(FILE *archive, FILE *newArchive, const char *name,
+  long long size, context *ctx)
+{
+  long long mtime = ctx->seen.members[ctx->seen.size-1].mtime;
+  int i = resolveLink(archive, &ctx->seen, ctx->seen.size-1);
+  if(i < 0) return false;
+  member *target = &ctx->seen.members[i];
+
+  if(!isNameInStack(&ctx->dropped, target->name))
+  {
+    writeMemberHeader(newArchive, name, LINKMARK, size, mtime, 0);
+    fputs(target->name, newArchive);
+    fseeko(archive, size, SEEK_CUR);
+    return true;
+  }
+
+  //a delta is rebuilt against its base
+  int b = (target->kind == DELTAMARK) ? findBase(&ctx->seen, i) : i;
+  long long len = memberLength(archive, target);
+  if(b < 0 || len < 0) return false;
+  long long pos = ftello(archive);
+  fseeko(archive, target->offset, SEEK_SET);
+  writeMemberHeader(newArchive, name, '\0', len, mtime, ctx->opts->align);
+  bool copied = (b == i) ? copyBytes(archive, newArchive, len, ctx) :
+    applyDelta(archive, &ctx->seen.members[b], target->size, newArchive,
+      ctx);
+  fseeko(archive, pos+size, SEEK_SET);
+  return copied;
+}
+
+//reports that a name given to d or x is not in the archive
+void reportNotFound(const char *name, char mode)
+{
+  if (mode == 'd') //report unable to delete
+    fprintf(stderr, "Could not delete file %s. Not found in archive\n", name);
+  else if (mode == 'x') //report unable to extract
+    fprintf(stderr, "Could not extract file %s. Not found in archive\n",
+      name);
+}
+
+//This method is called at the end of readArchive
+//Checks if any items in the input names array were not found
+//and takes appropriate action based on the mode
+//Takes as parameter the stack of input names, the stack of found names, the
+//name of the archive, the mode, and the context of the pass
+void checkForLeftoverNames(stack* nameStack, stack* found,
+  const char *newArchiveName, char mode, context *ctx)
+{
+  //printf("checking leftovers\n");
+  if (nameStack == NULL || mode == 't') return;
+  
+  node *temp = nameStack->head;
+  while(temp != NULL)
+  {
+    char *name = temp->name;
+    statTimer timer;
+    statsStart(ctx, &timer);
+    bool left = !isNameInStack(found, name) && !prefixOfStack(found, name);
+    statsStop(ctx, STATMATCH, &timer, 0);
+    if(left)
+    {
+      //printf("Found %s in stack at end\n", name);
+      if(mode == 'r')
+      {
+        bool wroteFile = false;
+        fileToArchive(name, name, newArchiveName,
+          found, nameStack, &wroteFile, ctx);
+      }
+      else reportNotFound(name, mode);
+    }
+    temp = temp->next;
+  }
+}
+
+//this method handles the actions for each mode when a filename found in
+//the archive does not match any filenames from the stack of input names
+//returns a bool indicating if archive is uncorrupted
+//takes as parameters the archive file pointer, the temporary archive name,
+//the filename that was found in the archive, the kind and size from its
+//header, the mode, and the context of the pass
+bool filenameNotMatched(FILE* archive, const char* newArchiveName,
+  const char* currentName, char kind, long long fileSize, char mode,
+  context *ctx)
+{
+  //printf("not matched %s\n", currentName);
+  if(mode == 'r' || mode == 'd') //copy file over without replace or delete
+  {
+    //printf("copying without replace %s\n", currentName);
+    FILE* newArchive = appendArchive(newArchiveName,
+      strlen(currentName)+fileSize+ctx->opts->align+24, ctx);
+    bool copied;
+    if(kind == LINKMARK)
+      copied = copyLink(archive, newArchive, currentName, fileSize, ctx);
+    else
+    {
+      writeMemberHeader(newArchive, currentName, kind, fileSize,
+        ctx->seen.members[ctx->seen.size-1].mtime, ctx->opts->align);
+      copied = copyBytes(archive, newArchive, fileSize, ctx);
+    }
+    closeWritten(newArchive, ctx);
+    ctx->stats.membersCopied++;
+    return copied;
+  }
+  else fseeko(archive, fileSize, SEEK_CUR); //go to next file in archive
+  return true;
+}
+
+//this method handles the actions for each mode when a filename found in
+//the archive matches a filename from the stack of input names
+//returns a bool indicating if the archive is uncorrupted
+//takes as parameters the archive file pointer, the temporary archive name,
+//the filename that was found in the archive, the kind and size from its
+//header, the stacks of found and input names, the mode, and the context of
+//the pass
+bool filenameMatched(FILE* archive, const char* newArchiveName,
+  char* currentName, char kind, long long fileSize, stack* found,
+  stack* nameStack, char mode, context *ctx)
+{
+  //printf("matched %s\n",currentName);
+  statTimer timer;
+  if(mode == 'r')
+  {
+    bool wroteFile = false;
+    removeTrailingSlashes(currentName);
+    //a name already found was stored again earlier in this pass, so the
+    //old member is dropped
+    statsStart(ctx, &timer);
+    bool archived = isNameInStack(found, currentName);
+    statsStop(ctx, STATMATCH, &timer, 0);
+    if(archived) wroteFile = true;
+    else fileToArchive(currentName, currentName,
+      newArchiveName, found, nameStack, &wroteFile, ctx);
+    if(!wroteFile)
+    {
+      //printf("did not write file %s\n", currentName);
+      return filenameNotMatched(archive, newArchiveName, currentName,
+        kind, fileSize, mode, ctx);
+    }
+    if(kind == '\0') dropMember(ctx, currentName);
+    fseeko(archive, fileSize, SEEK_CUR);
+  }
+  else if (mode == 'x')
+  {
+    //a later member with the same name holds a newer version
+    statsStart(ctx, &timer);
+    if(isNameInStack(found, currentName)) removeFromStack(found, currentName);
+    statsStop(ctx, STATMATCH, &timer, 0);
+
+    int j;
+    if(kind == LINKMARK)
+    {
+      j = extractLink(archive, currentName, found, ctx);
+      fseeko(archive, fileSize, SEEK_CUR);
+    }
+    else if(kind == DELTAMARK)
+      j = extractDelta(archive, currentName, found, ctx->seen.size-1, ctx);
+    else j = extractFile(archive, currentName, found, fileSize, ctx);
+    if(j != 0) return false;
+    ctx->stats.membersWritten++;
+  }
+  else if (mode == 't')
+  {
+    if(kind == LINKMARK)
+    {
+      int i = resolveLink(archive, &ctx->seen, ctx->seen.size-1);
+      if(i < 0) return false;
+      printf("%8lld %s link to %s\n",
+        memberLength(archive, &ctx->seen.members[i]), currentName,
+        ctx->seen.members[i].name);
+    }
+    else if(kind == DELTAMARK)
+      printf("%8lld %s delta\n",
+        memberLength(archive, &ctx->seen.members[ctx->seen.size-1]),
+        currentName);
+    else printf("%8lld %s\n", fileSize, currentName);
+    fseeko(archive, fileSize, SEEK_CUR);
+  }
+  else if (mode == 'd')
+  {
+    stackPush(found, currentName);
+    if(kind == '\0') dropMember(ctx, currentName);
+    fseeko(archive, fileSize, SEEK_CUR);
+  }
+  return true;
+}
+
+//This method traverses the archive once and calls filenameMatched or
+//filenameNotMatched when it recognizes a filename
+//it takes as parameters the name of the archive, a stack of input names,
+//the mode, and the command line options
+//returns 0 if there is no error, -1 if the archive is corrupted
+int readArchive(const char* archiveName, stack *nameStack, char mode,
+  const options *opts)
+{
+  //writers hold the writer lock of an indexed archive for the whole pass,
+  //readers the publish lock just while they open it
+  sidecar sc;
+  bool writer = (mode == 'r' || mode == 'd');
+  bool indexed = sidecarOpen(&sc, archiveName,
+    writer && (opts->concurrent || opts->bloom));
+  if(indexed)
+    sidecarLock(&sc, writer ? WRITERLOCK : PUBLISHLOCK,
+      writer ? F_WRLCK : F_RDLCK);
+  FILE *archive = opts->direct ? openDirect(archiveName) : NULL;
+  bool direct = (archive != NULL);
+  if(!direct) archive = fopen(archiveName,"r");
+  long long committed = (indexed && archive != NULL) ?
+    sidecarCommitted(&sc, archiveName) : -1;
+
+  //if the filter of the index rules out every name, there is nothing to do
+  bool ruledOut = (mode == 'd' || mode == 'x') && nameStack != NULL &&
+    nameStack->size > 0 && archive != NULL;
+  for(node *n=nameStack ? nameStack->head : NULL;n!=NULL && ruledOut;
+      n=n->next)
+    ruledOut = !bloomMayHave(&sc.filter, n->name);
+  for(node *n=ruledOut ? nameStack->head : NULL;n!=NULL;n=n->next)
+    reportNotFound(n->name, mode);
+
+  if(!writer || ruledOut || archive == NULL) sidecarClose(&sc);
+  if(archive == NULL) return -1;
+  if(ruledOut)
+  {
+    fclose(archive);
+    return 0;
+  }
+  if(mode == 'r' && opts->times)
+  {
+    memberTable t;
+    tableInit(&t);
+    //a corrupted archive is left to be reported by the pass
+    bool refused = scanArchiveTo(archive, &t, committed) &&
+      timesRefused(&t, archiveName);
+    freeTable(&t);
+    fseeko(archive, 0, SEEK_SET);
+    if(refused)
+    {
+      sidecarClose(&sc);
+      fclose(archive);
+      return -1;
+    }
+  }
+  int c;
+  char currentName[MAXLEN]; //place to hold filename being read
+  int currentNameIndex = 0;
+  char newArchiveName[strlen(archiveName)+10];
+  char checkpointName[strlen(archiveName)+10];
+  char identity[MAXLEN];
+  char temp[MAXLEN];
+  char prefix[MAXLEN];
+
+  for(int i=0;i<MAXLEN;i++) currentName[i] = temp[i] = prefix[i] = '\0';
+
+  //stack of the names that have been found
+  stack *found = malloc(sizeof(stack));
+  stackInit(found);
+
+  //deltas map their base, which an O_DIRECT stream cannot provide, so the
+  //descriptor for plain reads is opened before the context takes its first
+  //cache sample and gives its advice on it
+  context ctx;
+  contextInit(&ctx, opts, archive,
+    direct ? open(archiveName, O_RDONLY) : fileno(archive));
+
+  //a checkpointed r resumes the same pass if it was interrupted
+  bool checkpointed = (mode == 'r' && opts->checkpoint > 0);
+  sprintf(checkpointName, "%s.ckpt", archiveName);
+  sprintf(newArchiveName, "%s.bak", archiveName);
+  if(checkpointed) checkpointIdentity(archiveName, nameStack, identity);
+  if(!checkpointed || !resumeCheckpoint(&ctx, checkpointName, identity,
+       archiveName, newArchiveName))
+    createTemporaryArchiveFileIfNecessary(newArchiveName, archiveName, mode);
+  if(checkpointed)
+    startCheckpoint(&ctx, checkpointName, identity, newArchiveName);
+  if(opts->nocache && (mode == 'r' || mode == 'd'))
+    ctx.newArchiveFd = open(newArchiveName, O_WRONLY);
+
+  //members appended after the committed length are not published yet
+  while( (c = (currentNameIndex == 0 && committed >= 0 &&
+               ftello(archive) >= committed) ? EOF : getc(archive)) != EOF)
+  {
+    if(c != '\n')
+    {
+      currentName[currentNameIndex] = c;
+      currentNameIndex++;
+      continue;
+    }
+    else //found a filename
+    {
+      currentName[currentNameIndex] = '\0';
+      //fprintf(stderr,"  %s\n",currentName);
+
+      for(int i=0;i<=currentNameIndex;i++) temp[i] = currentName[i];
+
+      removeTrailingSlashes(temp);
+
+      statTimer timer;
+      statsStart(&ctx, &timer);
+      bool match = (nameStack == NULL);
+      if(stackHasPrefix(nameStack, temp, prefix))
+      {
+        struct stat buf;
+        //check if containing directory can be opened
+        if(mode == 'r')
+        {
+          if(lstat(prefix, &buf) != 0) match = false;
+          else match = true;
+        }
+        else match = true;
+      }
+      match = match || isNameInStack(nameStack, temp);
+      statsStop(&ctx, STATMATCH, &timer, 0);
+
+      currentNameIndex = 0; //get ready to read another name
+
+      char kind;
+      long long fileSize, mtime;
+      bool uncorrupted = readMemberHeader(archive, &kind, &fileSize, &mtime);
+      if(uncorrupted)
+      {
+        tablePush(&ctx.seen, currentName, kind, ftello(archive), fileSize,
+          mtime);
+        if(match)
+          uncorrupted = filenameMatched(archive, newArchiveName, currentName,
+            kind, fileSize, found, nameStack, mode, &ctx);
+        else
+          uncorrupted = filenameNotMatched(archive, newArchiveName,
+            currentName, kind, fileSize, mode, &ctx);
+      }
+      if(!uncorrupted) break;
+      if(checkpointed)
+      {
+        ctx.nextMember = ftello(archive);
+        checkpointIfDue(&ctx);
+      }
+    }
+  }
+
+  if(c != EOF || currentNameIndex != 0)
+  {
+    if(direct) close(ctx.archiveFd);
+    fclose(archive);
+    archiveCorrupted(found);
+    freeContext(&ctx);
+    if(checkpointed) unlink(checkpointName);
+    sidecarClose(&sc);
+    return -1;
+  }
+
+  checkForLeftoverNames(nameStack, found, newArchiveName, mode, &ctx);
+  if(mode == 'x') finishSync(&ctx);
+  if(opts->nocache)
+  {
+    trimCache(&ctx);
+    trimCache(&ctx); //the second call drops what the first handed to writeback
+  }
+  if(opts->cacheReport) reportCache(&ctx);
+  if(opts->throttleBytes > 0 || opts->throttleOps > 0) reportRates(&ctx);
+  if(opts->stats) reportStats(&ctx, mode, nameStack, found);
+  if(direct) close(ctx.archiveFd);
+  freeContext(&ctx);
+
+  fclose(archive);
+
+  if(writer) syncArchive(newArchiveName, opts);
+  if(sc.fd >= 0)
+  {
+    sidecarFilter(&sc, newArchiveName, NULL, opts->bloom);
+    sidecarPublish(&sc, archiveName, newArchiveName);
+  }
+  else if(mode == 'd' || mode == 'r') rename(newArchiveName,archiveName);
+  if(writer) syncPublished(archiveName, &sc, opts);
+  if(checkpointed) unlink(checkpointName);
+  sidecarClose(&sc);
+
+  freeStack(found);
+  free(found);
+  return 0;
+}
+
+//Appends the input names to the archive in place instead of rewriting the
+//archive. With the delta option, files already in the archive are stored as
+//deltas against their archived version (see storeAsDelta). If the archive
+//turns out to be corrupted or the append fails, the archive is truncated back
+//to its original size
+//it takes as parameters the name of the archive, a stack of input names,
+//and the command line options
+//returns 0 if there is no error, -1 if the archive is corrupted or the
+//append failed
+int appendToArchive(const char* archiveName, stack *nameStack,
+  const options *opts)
+{
+  //with an index, whatever an interrupted writer left after the committed
+  //members is dropped, and the new members are published when they parse
+  sidecar sc;
+  if(sidecarOpen(&sc, archiveName, opts->concurrent || opts->bloom))
+    sidecarLock(&sc, WRITERLOCK, F_WRLCK);
+  //opened without O_DIRECT even with the direct option: storeAsDelta and
+  //memberHolds map archived versions through the descriptor of this stream,
+  //which the O_DIRECT stream of openDirect does not have
+  FILE *archive = fopen(archiveName,"r");
+  if(archive == NULL)
+  {
+    sidecarClose(&sc);
+    return -1;
+  }
+  long long committed = (sc.fd >= 0) ? sidecarCommitted(&sc, archiveName) : -1;
+  if(committed >= 0 && truncate(archiveName, committed) != 0)
+    fprintf(stderr, "Could not drop the unpublished end of %s\n",
+      archiveName);
+  struct stat buf;
+  fstat(fileno(archive), &buf);
+
+  context ctx;
+  contextInit(&ctx, opts, archive, fileno(archive));
+  ctx.inPlace = true;
+  bool scanned = scanArchive(archive, &ctx.seen);
+  if(!scanned || (opts->times && timesRefused(&ctx.seen, archiveName)))
+  {
+    fclose(archive);
+    if(!scanned) archiveCorrupted(NULL);
+    freeContext(&ctx);
+    sidecarClose(&sc);
+    return -1;
+  }
+
+  stack *found = malloc(sizeof(stack));
+  stackInit(found);
+
+  for(node *temp = nameStack->head;temp!=NULL;temp = temp->next)
+  {
+    bool wroteFile = false;
+    fileToArchive(temp->name, temp->name, archiveName,
+      found, nameStack, &wroteFile, &ctx);
+  }
+
+  //the new members must parse, otherwise drop them
+  memberTable check;
+  tableInit(&check);
+  fseeko(archive, buf.st_size, SEEK_SET);
+  bool appended = scanArchive(archive, &check);
+  if(!appended)
+  {
+    fprintf(stderr, "Append to %s failed. Restoring archive.\n",
+      archiveName);
+    if(truncate(archiveName, buf.st_size) != 0)
+      fprintf(stderr, "Could not restore archive %s\n", archiveName);
+    freeTable(&check);
+  }
+  if(sc.fd >= 0) sidecarFilter(&sc, archiveName, &check, opts->bloom);
+  freeTable(&check);
+
+  if(opts->cacheReport) reportCache(&ctx);
+  if(opts->throttleBytes > 0 || opts->throttleOps > 0) reportRates(&ctx);
+  if(opts->stats) reportStats(&ctx, 'r', nameStack, found);
+  fclose(archive);
+  freeContext(&ctx);
+  syncArchive(archiveName, opts);
+  if(sc.fd >= 0) sidecarPublish(&sc, archiveName, NULL);
+  syncPublished(archiveName, &sc, opts);
+  sidecarClose(&sc);
+  freeStack(found);
+  free(found);
+  return appended ? 0 : -1;
+}
+
+//writes all of buf to file descriptor fd
+//returns false on error
+bool writeAll(int fd, const char *buf, size_t len)
+{
+  while(len > 0)
+  {
+    ssize_t n = write(fd, buf, len);
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0) return false;
+    buf += n;
+    len -= n;
+  }
+  return true;
+}
+
+//sends all of buf on socket fd, getting EPIPE rather than SIGPIPE if the
+//peer has hung up
+//returns false on error
+bool sendAll(int fd, const char *buf, size_t len)
+{
+  while(len > 0)
+  {
+    ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0) return false;
+    buf += n;
+    len -= n;
+  }
+  return true;
+}
+
+//sends len bytes of the archive starting at offset to file descriptor out,
+//without copying them through user space where the kernel allows it: with
+//splice if out is a pipe, otherwise with sendfile
+//returns false on error
+bool sendArchiveRange(int archiveFd, long long offset, long long len, int out)
+{
+  loff_t off = offset;
+  while(len > 0)
+  {
+    ssize_t n = splice(archiveFd, &off, out, NULL, len, SPLICE_F_MORE);
+    if(n < 0 && errno == EINTR) continue;
+    if(n < 0 && (errno == EINVAL || errno == ENOSYS)) break;
+    if(n <= 0) return false;
+    len -= n;
+  }
+
+  while(len > 0)
+  {
+    ssize_t n = sendfile(out, archiveFd, &off, len);
+    if(n < 0 && errno == EINTR) continue;
+    if(n < 0 && (errno == EINVAL || errno == ENOSYS)) break;
+    if(n <= 0) return false;
+    len -= n;
+  }
+
+  char buf[BUFSIZ];
+  while(len > 0) //fallback when sendfile cannot handle the descriptors
+  {
+    ssize_t n = pread(archiveFd, buf, (len < BUFSIZ) ? len : BUFSIZ, off);
+    if(n <= 0 || !writeAll(out, buf, n)) return false;
+    off += n;
+    len -= n;
+  }
+  return true;
+}
+
+//Prints the contents of the named members to stdout, one after the other in
+//the order the names were given (the latest version of a name that occurs
+//more than once). Only the member headers are read to find the members, and
+//plain members are then sent from their offset in the archive by
+//sendArchiveRange, so unrelated member data is never read. With the range
+//options only that range of each member is printed
+//it takes as parameters the name of the archive, a stack of input names,
+//and the command line options
+//returns 0 if there is no error, -1 if the archive is corrupted, a name is
+//not a file in the archive or printing fails
+int printMembers(const char *archiveName, stack *nameStack,
+  const options *opts)
+{
+  long long committed;
+  FILE *archive = openSnapshot(archiveName, &committed);
+  if(archive == NULL) return -1;
+  memberTable t;
+  tableInit(&t);
+  if(!scanArchiveTo(archive, &t, committed))
+  {
+    fclose(archive);
+    freeTable(&t);
+    archiveCorrupted(NULL);
+    return -1;
+  }
+
+  //the stack holds the names in reverse order
+  node *names[nameStack->size];
+  int numNames = 0;
+  for(node *temp = nameStack->head;temp!=NULL;temp = temp->next)
+    names[numNames++] = temp;
+
+  bool corrupted = false, failed = false, missing = false;
+  for(int k=numNames-1;k>=0 && !corrupted && !failed;k--)
+  {
+    const char *name = names[k]->name;
+    int i = tableFind(&t, name);
+    if(i < 0)
+    {
+      fprintf(stderr, "Could not print %s. Not found in archive\n", name);
+      missing = true;
+      continue;
+    }
+    if(t.members[i].name[strlen(t.members[i].name)-1] == '/')
+    {
+      fprintf(stderr, "Could not print %s. It is a directory\n", name);
+      missing = true;
+      continue;
+    }
+
+    int j = resolveLink(archive, &t, i);
+    member *m = (j < 0) ? NULL : &t.members[j];
+    int b = (m != NULL && m->kind == DELTAMARK) ? findBase(&t, j) : j;
+    long long fileLen = (b < 0) ? -1 : memberLength(archive, m);
+    long long from = opts->rangeOffset, len = opts->rangeLength;
+    if(fileLen < 0) corrupted = true;
+    else clipRange(fileLen, &from, &len);
+
+    if(corrupted) break;
+    else if(m->kind != DELTAMARK)
+    {
+      fflush(stdout);
+      failed = !sendArchiveRange(fileno(archive), m->offset + from, len,
+        STDOUT_FILENO);
+    }
+    else
+    {
+      fseeko(archive, m->offset, SEEK_SET);
+      corrupted = !applyDeltaRange(archive, &t.members[b], m->size, from, len,
+        stdout, NULL);
+    }
+    if(failed) fprintf(stderr, "Could not print %s\n", name);
+  }
+  fflush(stdout);
+
+  fclose(archive);
+  freeTable(&t);
+  if(corrupted) archiveCorrupted(NULL);
+  return (corrupted || failed || missing) ? -1 : 0;
+}
+
+//a member name in one of the archives being merged: name is the member name
+//without trailing slashes, archive the index of the archive it is in and
+//winner the index of the archive whose members of that name are kept
+typedef struct mergeName_t
+{
+  char *name;
+  int archive;
+  int winner;
+} mergeName;
+
+//qsort and bsearch comparison of merge names, by name and then by archive
+int compareMergeNames(const void *a, const void *b)
+{
+  const mergeName *x = a, *y = b;
+  int c = strcmp(x->name, y->name);
+  if(c != 0 || x->archive < 0 || y->archive < 0) return c;
+  return (x->archive > y->archive) - (x->archive < y->archive);
+}
+
+//copies len bytes of in starting at offset to the end of out with
+//copy_file_range, which lets the file system share the blocks instead of
+//copying them where it supports that, falling back to sendArchiveRange
+//returns false on error
+bool copyArchiveRange(int in, long long offset, long long len, int out)
+{
+  loff_t off = offset;
+  while(len > 0)
+  {
+    ssize_t n = copy_file_range(in, &off, out, NULL, len, 0);
+    if(n < 0 && errno == EINTR) continue;
+    if(n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+       errno == EOPNOTSUPP)) break;
+    if(n <= 0) return false;
+    len -= n;
+  }
+  return sendArchiveRange(in, off, len, out);
+}
+
+//copies member i of the archive with member table t to the end of out,
+//aligning its data to align (see headerPadding). a link whose target is not
+//copied along with it is stored as a plain member holding the target's data
+//returns false if the archive is corrupted or the copy fails
+bool mergeMember(FILE *archive, memberTable *t, int i, bool keepLink,
+  long long align, int out)
+{
+  member *m = &t->members[i];
+  int j = (keepLink || m->kind != LINKMARK) ? i : resolveLink(archive, t, i);
+  if(j < 0) return false;
+  member *data = &t->members[j];
+  //a link to a delta is stored with the data of the delta rebuilt
+  bool rebuild = i != j && data->kind == DELTAMARK;
+  int b = rebuild ? findBase(t, j) : j;
+  char kind = rebuild ? '\0' : data->kind;
+  long long size = rebuild ? memberLength(archive, data) : data->size;
+  if(b < 0 || size < 0) return false;
+
+  long long pad = headerPadding(lseek(out, 0, SEEK_CUR), m->name, kind, size,
+    m->mtime, align);
+  char *header = malloc(strlen(m->name) + pad + 64);
+  int len = sprintf(header, "%s\n", m->name);
+  memset(header+len, ' ', pad);
+  len += pad;
+  if(m->mtime >= 0) len += sprintf(header+len, "%c%lld ", TIMEMARK, m->mtime);
+  if(kind != '\0') header[len++] = kind;
+  len += sprintf(header+len, "%lld|", size);
+  bool copied = writeAll(out, header, len);
+  free(header);
+  if(!copied || !rebuild)
+    return copied &&
+      copyArchiveRange(fileno(archive), data->offset, data->size, out);
+
+  FILE *stream = fdopen(dup(out), "w");
+  if(stream == NULL) return false;
+  fseeko(archive, data->offset, SEEK_SET);
+  copied = applyDelta(archive, &t->members[b], data->size, stream, NULL);
+  return (fclose(stream) == 0) && copied;
+}
+
+//Merges the input archives into the archive. The archive itself comes
+//first, followed by the inputs in the order given. When a name occurs in
+//more than one of them, every member of that name is kept from a single
+//archive (the last one with firstWins unset, the first one otherwise), so
+//that deltas keep their bases. Members are found by reading the headers
+//only, and their data is copied with copyArchiveRange. The merged archive is
+//written to ARCHIVE.bak and renamed over the archive
+//it takes as parameters the name of the archive, a stack of input archive
+//names, and the command line options
+//returns 0 if there is no error, -1 if an input cannot be read or is
+//corrupted or the merged archive cannot be written
+int mergeArchives(const char *archiveName, stack *nameStack,
+  const options *opts)
+{
+  //the stack holds the names in reverse order
+  int numArchives = 1;
+  const char *names[nameStack->size+1];
+  names[0] = archiveName;
+  node *temp = nameStack->head;
+  for(int k=nameStack->size;k>0;k--, temp = temp->next) names[k] = temp->name;
+  numArchives += nameStack->size;
+
+  //the merged archive is written like r writes it, under its writer lock
+  sidecar sc;
+  if(sidecarOpen(&sc, archiveName, opts->concurrent || opts->bloom))
+  {
+    sidecarLock(&sc, WRITERLOCK, F_WRLCK);
+    sidecarRead(&sc);
+  }
+
+  FILE *archives[numArchives];
+  memberTable tables[numArchives];
+  int numNames = 0, opened = 0;
+  bool ok = true;
+  for(;opened<numArchives && ok;opened++)
+  {
+    tableInit(&tables[opened]);
+    long long committed;
+    archives[opened] = openSnapshot(names[opened], &committed);
+    if(archives[opened] == NULL)
+    {
+      fprintf(stderr, "Could not open archive %s\n", names[opened]);
+      ok = false;
+    }
+    else if(!scanArchiveTo(archives[opened], &tables[opened], committed))
+    {
+      fprintf(stderr, "Archive %s is corrupted\n", names[opened]);
+      ok = false;
+    }
+    else numNames += tables[opened].size;
+  }
+
+  //pick the archive that every name is kept from
+  mergeName *all = malloc((numNames+1)*sizeof(mergeName));
+  int n = 0;
+  for(int a=0;a<opened && ok;a++)
+    for(int i=0;i<tables[a].size;i++)
+    {
+      all[n].name = strdup(tables[a].members[i].name);
+      removeTrailingSlashes(all[n].name);
+      all[n++].archive = a;
+    }
+  qsort(all, n, sizeof(mergeName), compareMergeNames);
+  for(int i=0;i<n;)
+  {
+    int k = i;
+    while(k < n && strcmp(all[k].name, all[i].name) == 0) k++;
+    int winner = opts->firstWins ? all[i].archive : all[k-1].archive;
+    for(;i<k;i++) all[i].winner = winner;
+  }
+
+  char newArchiveName[strlen(archiveName)+10];
+  strcpy(newArchiveName, archiveName);
+  strcat(newArchiveName, ".bak");
+  int out = ok ? open(newArchiveName, O_WRONLY | O_CREAT | O_TRUNC, 0666) : -1;
+  if(ok && out < 0) fprintf(stderr, "Could not create %s\n", newArchiveName);
+  ok = ok && out >= 0;
+
+  char stripped[MAXLEN];
+  for(int a=0;a<opened && ok;a++)
+    for(int i=0;i<tables[a].size && ok;i++)
+    {
+      member *m = &tables[a].members[i];
+      strcpy(stripped, m->name);
+      removeTrailingSlashes(stripped);
+      mergeName key = {stripped, -1, -1};
+      mergeName *found = bsearch(&key, all, n, sizeof(mergeName),
+        compareMergeNames);
+      if(found->winner != a) continue;
+
+      //a link is kept as one if its target is kept from the same archive
+      bool keepLink = true;
+      if(m->kind == LINKMARK)
+      {
+        int j = resolveLink(archives[a], &tables[a], i);
+        if(j >= 0)
+        {
+          strcpy(stripped, tables[a].members[j].name);
+          removeTrailingSlashes(stripped);
+          keepLink = ((mergeName*)bsearch(&key, all, n, sizeof(mergeName),
+            compareMergeNames))->winner == a;
+        }
+      }
+      ok = mergeMember(archives[a], &tables[a], i, keepLink, opts->align,
+        out);
+      if(!ok) fprintf(stderr, "Could not merge %s from %s\n", m->name,
+        names[a]);
+    }
+
+  if(out >= 0 && close(out) != 0) ok = false;
+  if(ok) syncArchive(newArchiveName, opts);
+  if(ok && sc.fd >= 0)
+  {
+    sidecarFilter(&sc, newArchiveName, NULL, opts->bloom);
+    sidecarPublish(&sc, archiveName, newArchiveName);
+  }
+  else if(ok) rename(newArchiveName, archiveName);
+  else if(out >= 0) unlink(newArchiveName);
+  if(ok) syncPublished(archiveName, &sc, opts);
+  sidecarClose(&sc);
+
+  for(int i=0;i<n;i++) free(all[i].name);
+  free(all);
+  for(int a=0;a<opened;a++)
+  {
+    if(archives[a] != NULL) fclose(archives[a]);
+    freeTable(&tables[a]);
+  }
+  return ok ? 0 : -1;
+}
+
+//an archive held open by the server, along with the identity of the file its
+//member index was read from so that a rewritten archive can be rescanned.
+//path is the canonical name of the archive, which requests are matched with
+typedef struct servedArchive_t
+{
+  const char *name;
+  char *path;
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  bool loaded;
+  memberIndex index;
+} servedArchive;
+
+//opens a served archive into *archive (NULL if it cannot be opened) and
+//(re)reads its member index from that same open file if the file changed
+//since it was last scanned, so that a writer renaming a new archive into
+//place cannot pair the index of one file with the data of another
+//returns false if the archive cannot be read or is corrupted
+bool loadServedArchive(servedArchive *a, FILE **archive)
+{
+  long long committed;
+  struct stat buf;
+  *archive = openSnapshot(a->name, &committed);
+  if(*archive == NULL || fstat(fileno(*archive), &buf) != 0) return false;
+  if(a->loaded && a->dev == buf.st_dev && a->ino == buf.st_ino &&
+     a->size == buf.st_size && a->mtime.tv_sec == buf.st_mtim.tv_sec &&
+     a->mtime.tv_nsec == buf.st_mtim.tv_nsec) return true;
+
+  memberTable t;
+  tableInit(&t);
+  freeIndex(&a->index);
+  a->loaded = scanArchiveTo(*archive, &t, committed);
+  if(a->loaded) indexBuild(&a->index, &t);
+  freeTable(&t);
+  if(!a->loaded) return false;
+  a->dev = buf.st_dev;
+  a->ino = buf.st_ino;
+  //until a writer publishes what it appends, the archive is longer than
+  //what was read, so it is read again
+  a->size = (committed >= 0) ? committed : buf.st_size;
+  a->mtime = buf.st_mtim;
+  return true;
+}
+
+//sends an error line in response to a request
+//always returns false so that failed requests can return its result
+bool serveError(int client, const char *message)
+{
+  char line[MAXLEN+16];
+  snprintf(line, sizeof(line), "ERR %s\n", message);
+  sendAll(client, line, strlen(line));
+  return false;
+}
+
+//returns member i of a member index as a member, without its name or mtime
+member indexMember(memberIndex *ix, int i)
+{
+  member m = {NULL, ix->entries[i].kind, ix->entries[i].offset,
+    ix->entries[i].size, -1};
+  return m;
+}
+
+//copies the name of member i of a member index, as stored in the archive,
+//into name
+void indexName(memberIndex *ix, int i, char *name)
+{
+  nameTableGet(&ix->names, ix->entries[i].name, name);
+  if(ix->entries[i].dir) strcat(name, "/");
+}
+
+//returns the index of the member holding the data for member i of a member
+//index, as resolveLink does for a member table
+int indexResolveLink(FILE *archive, memberIndex *ix, int i)
+{
+  if(ix->entries[i].kind != LINKMARK) return i;
+
+  char target[MAXLEN];
+  fseeko(archive, ix->entries[i].offset, SEEK_SET);
+  if(!readLinkTarget(archive, ix->entries[i].size, target)) return -1;
+  int id = nameTableFind(&ix->names, target);
+  for(int j=i-1;j>=0 && id >= 0;j--)
+    if(ix->entries[j].name == id)
+      return (ix->entries[j].kind != LINKMARK) ? j : -1;
+  return -1;
+}
+
+//returns the index of the base of delta member i of a member index, as
+//findBase does for a member table
+int indexFindBase(memberIndex *ix, int i)
+{
+  for(int j=i-1;j>=0;j--)
+    if(ix->entries[j].name == ix->entries[i].name &&
+       ix->entries[j].kind == '\0') return j;
+  return -1;
+}
+
+//answers a request for the open archive with member index ix
+//returns false if the request could not be answered
+bool answerRequest(int client, FILE *archive, memberIndex *ix,
+  const char *key, const char *memberName)
+{
+  char line[2*MAXLEN+32];
+  char name[MAXLEN+1], target[MAXLEN+1];
+  if(strcmp(key, "t") == 0)
+  {
+    sendAll(client, "OK\n", 3);
+    for(int i=0;i<ix->size;i++)
+    {
+      int j = indexResolveLink(archive, ix, i);
+      if(j < 0) return false;
+      member m = indexMember(ix, j);
+      long long len = memberLength(archive, &m);
+      indexName(ix, i, name);
+      if(i != j)
+      {
+        indexName(ix, j, target);
+        snprintf(line, sizeof(line), "%8lld %s link to %s\n", len, name,
+          target);
+      }
+      else snprintf(line, sizeof(line), "%8lld %s%s\n", len, name,
+        (m.kind == DELTAMARK) ? " delta" : "");
+      if(!sendAll(client, line, strlen(line))) return false;
+    }
+    return true;
+  }
+  if(strcmp(key, "s") != 0 && strcmp(key, "x") != 0)
+    return serveError(client, "unknown key");
+
+  int id = nameTableFind(&ix->names, memberName);
+  int i = (id < 0) ? -1 : ix->latest[id];
+  if(i < 0) return serveError(client, "not found in archive");
+  int j = indexResolveLink(archive, ix, i);
+  if(j < 0) return serveError(client, "archive corrupted");
+  member m = indexMember(ix, j); //holds the data of member i
+  long long len = memberLength(archive, &m);
+  int b = (m.kind == DELTAMARK) ? indexFindBase(ix, j) : j;
+  if(len < 0 || b < 0) return serveError(client, "archive corrupted");
+
+  indexName(ix, i, name);
+  if(strcmp(key, "s") == 0)
+    snprintf(line, sizeof(line), "OK\n%lld %s\n", len, name);
+  else snprintf(line, sizeof(line), "OK %lld %s\n", len, name);
+  if(!sendAll(client, line, strlen(line))) return false;
+  if(strcmp(key, "x") != 0) return true;
+  if(m.kind != DELTAMARK)
+    return sendArchiveRange(fileno(archive), m.offset, m.size, client);
+
+  FILE *out = fdopen(dup(client), "w");
+  member base = indexMember(ix, b);
+  fseeko(archive, m.offset, SEEK_SET);
+  bool sent = applyDelta(archive, &base, m.size, out, NULL);
+  return (fclose(out) == 0) && sent;
+}
+
+//answers a single request read from the client socket. requests are
+//newline-terminated fields: the key (t, s or x), the archive name and, for
+//s and x, the member name. the reply is "OK" or "ERR message" on one line,
+//followed for t by the member listing, for s by the size and stored name and
+//for x by the size and stored name and then the member bytes
+//returns false if the request could not be answered
+bool serveRequest(int client, servedArchive *archives, int numArchives)
+{
+  //the request ends at its third newline, so it is not read up to the end
+  //of the stream, which a client need not close
+  char request[2*MAXLEN+4];
+  size_t len = 0;
+  int lines = 0;
+  ssize_t n;
+  while(lines < 3 && len < sizeof(request)-1 &&
+        (n = read(client, request+len, sizeof(request)-1-len)) > 0)
+  {
+    for(ssize_t i=0;i<n;i++) lines += request[len+i] == '\n';
+    len += n;
+  }
+  request[len] = '\0';
+
+  char *key = request;
+  char *archiveName = strchr(key, '\n');
+  if(archiveName == NULL) return serveError(client, "malformed request");
+  *archiveName++ = '\0';
+  char *memberName = strchr(archiveName, '\n');
+  if(memberName == NULL) return serveError(client, "malformed request");
+  *memberName++ = '\0';
+  char *end = strchr(memberName, '\n');
+  if(end != NULL) *end = '\0';
+  removeTrailingSlashes(memberName);
+
+  //names are compared once canonical, so ./ar and the absolute path of ar
+  //both find ar
+  char *path = realpath(archiveName, NULL);
+  servedArchive *a = NULL;
+  for(int i=0;i<numArchives;i++)
+    if(strcmp(archives[i].path, (path == NULL) ? archiveName : path) == 0)
+      a = &archives[i];
+  free(path);
+  if(a == NULL) return serveError(client, "archive not served");
+  FILE *archive;
+  if(!loadServedArchive(a, &archive))
+  {
+    if(archive == NULL) return serveError(client, "archive not readable");
+    fclose(archive);
+    return serveError(client, "archive corrupted");
+  }
+  bool answered = answerRequest(client, archive, &a->index, key, memberName);
+  fclose(archive);
+  return answered;
+}
+
+//runs the resident server: keeps the member indexes of the named archives in
+//memory and answers requests on a unix domain socket until killed
+//returns EXIT_FAILURE if the server cannot be started
+//takes as parameters the socket path and the archive names
+int farServe(const char *socketName, char *names[], int namesLen)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(strlen(socketName) >= sizeof(addr.sun_path))
+    return FARERROR("Socket name %s is too long\n", socketName);
+  strcpy(addr.sun_path, socketName);
+
+  servedArchive archives[namesLen];
+  memset(archives, 0, sizeof(archives));
+  for(int i=0;i<namesLen;i++)
+  {
+    archives[i].name = names[i];
+    archives[i].path = realpath(names[i], NULL);
+    indexInit(&archives[i].index);
+    FILE *archive = NULL;
+    bool loaded = archives[i].path != NULL &&
+      loadServedArchive(&archives[i], &archive);
+    if(archive != NULL) fclose(archive);
+    if(!loaded)
+    {
+      for(int j=0;j<=i;j++) free(archives[j].path);
+      for(int j=0;j<i;j++) freeIndex(&archives[j].index);
+      return FARERROR("Could not load archive %s\n", names[i]);
+    }
+  }
+
+  int server = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(socketName);
+  if(server < 0 || bind(server, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+     listen(server, 64) != 0)
+  {
+    for(int i=0;i<namesLen;i++)
+    {
+      free(archives[i].path);
+      freeIndex(&archives[i].index);
+    }
+    return FARERROR("Could not listen on socket %s\n", socketName);
+  }
+
+  //a client that hangs up mid-reply makes splice, sendfile and the writes
+  //of rebuilt deltas raise SIGPIPE: it is blocked in this thread only, and
+  //taken back after each client
+  sigset_t pipeSignal;
+  sigemptyset(&pipeSignal);
+  sigaddset(&pipeSignal, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &pipeSignal, NULL);
+  struct timespec now = {0, 0};
+  while(true)
+  {
+    //clients are served one at a time, so one that stalls is given up on
+    //after SERVETIMEOUT seconds instead of holding up the others
+    int client = accept(server, NULL, NULL);
+    if(client < 0) continue;
+    struct timeval timeout = {SERVETIMEOUT, 0};
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    serveRequest(client, archives, namesLen);
+    close(client);
+    while(sigtimedwait(&pipeSignal, NULL, &now) > 0);
+  }
+}
+
+//sends one request to a running server and prints the reply. members
+//requested with x are extracted the same way Far x extracts them
+//takes as parameters the socket path, the key, the archive name and the
+//member name (NULL for t)
+int farQuery(const char *socketName, const char *key,
+  const char *archiveName, const char *memberName)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, socketName, sizeof(addr.sun_path)-1);
+
+  int server = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(server < 0 || connect(server, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+  {
+    if(server >= 0) close(server);
+    return FARERROR("Could not connect to socket %s\n", socketName);
+  }
+
+  //the server may run in another directory, so the name is sent canonical
+  char *path = realpath(archiveName, NULL);
+  char request[2*MAXLEN+4];
+  snprintf(request, sizeof(request), "%s\n%s\n%s\n", key,
+    (path == NULL) ? archiveName : path,
+    (memberName == NULL) ? "" : memberName);
+  free(path);
+  sendAll(server, request, strlen(request));
+  shutdown(server, SHUT_WR);
+
+  FILE *reply = fdopen(server, "r");
+  char status[MAXLEN+16];
+  if(fgets(status, sizeof(status), reply) == NULL)
+  {
+    fclose(reply);
+    return FARERROR("No reply from server on %s\n", socketName);
+  }
+  if(strncmp(status, "OK", 2) != 0)
+  {
+    fprintf(stderr, "%s: %s", memberName ? memberName : archiveName,
+      status+4);
+    fclose(reply);
+    return EXIT_FAILURE;
+  }
+
+  int c;
+  if(strcmp(key, "x") == 0)
+  {
+    long long size;
+    int nameStart;
+    if(sscanf(status, "OK %lld %n", &size, &nameStart) != 1)
+    {
+      fclose(reply);
+      return FARERROR("Malformed reply from server on %s\n", socketName);
+    }
+    status[strcspn(status, "\n")] = '\0';
+
+    stack *found = malloc(sizeof(stack));
+    stackInit(found);
+    //extractFile frees the stack itself if the stream ends early
+    if(extractFile(reply, status+nameStart, found, size, NULL) != 0)
+    {
+      fclose(reply);
+      return EXIT_FAILURE;
+    }
+    freeStack(found);
+    free(found);
+  }
+  else while( (c = getc(reply)) != EOF) putchar(c);
+
+  fclose(reply);
+  return EXIT_SUCCESS;
+}
+
+
+//archive indexed by a catalog, as listed at the start of the catalog file:
+//its absolute name, the size and modification time it had when it was
+//indexed, and whether its entries in the catalog are still current
+typedef struct catalogArchive_t
+{
+  char *name;
+  long long size;
+  long long sec;
+  long long nsec;
+  bool current;
+  int oldIndex; //index in the catalog being updated, -1 if it is new
+} catalogArchive;
+
+//growable array of lines, used for the entries of a catalog
+typedef struct lineList_t
+{
+  char **lines;
+  int size;
+  int capacity;
+} lineList;
+
+//copies line and appends it to list l
+void linePush(lineList *l, const char *line)
+{
+  if(l->size == l->capacity)
+  {
+    l->capacity = (l->capacity == 0) ? 64 : 2*l->capacity;
+    l->lines = realloc(l->lines, l->capacity*sizeof(char*));
+  }
+  l->lines[l->size++] = strdup(line);
+}
+
+//compares two catalog entries by path, which is the part of the line before
+//the first tab
+int compareCatalogPaths(const char *a, const char *b)
+{
+  for(;*a == *b && *a != '\t' && *a != '\0';a++, b++);
+  unsigned char x = (*a == '\t') ? 0 : *a, y = (*b == '\t') ? 0 : *b;
+  return (x > y) - (x < y);
+}
+
+//qsort comparison of two catalog entries, see compareCatalogPaths
+int compareCatalogLines(const void *a, const void *b)
+{
+  return compareCatalogPaths(*(char* const*)a, *(char* const*)b);
+}
+
+//reads the list of archives at the start of an open catalog, leaving the
+//catalog positioned at its first entry
+//returns false if the catalog is corrupted
+bool readCatalogHeader(FILE *catalog, catalogArchive **archives, int *num)
+{
+  *archives = NULL;
+  *num = 0;
+  int n;
+  if(fscanf(catalog, "Far catalog %d", &n) != 1 || getc(catalog) != '\n' ||
+     n < 0) return false;
+  *archives = calloc(n+1, sizeof(catalogArchive));
+  char name[MAXLEN];
+  for(;*num<n;(*num)++)
+  {
+    catalogArchive *a = &(*archives)[*num];
+    if(fscanf(catalog, "%lld\t%lld\t%lld\t", &a->size, &a->sec,
+         &a->nsec) != 3 ||
+       fgets(name, MAXLEN, catalog) == NULL || strchr(name, '\n') == NULL)
+      return false;
+    *strchr(name, '\n') = '\0';
+    a->name = strdup(name);
+  }
+  return true;
+}
+
+//frees a list of catalog archives
+void freeCatalogArchives(catalogArchive *archives, int num)
+{
+  for(int i=0;i<num;i++) free(archives[i].name);
+  free(archives);
+}
+
+//adds a catalog entry to l for the latest member of every name in the
+//archive with index a in the catalog. an entry is the member path (without
+//trailing slashes), the archive index, the kind ('-' for files, 'd' for
+//directories, '@' for links, '+' for deltas), the size of the file and the
+//offset of the member data in the archive, separated by tabs
+//returns false if the archive cannot be read or is corrupted
+bool catalogEntries(const char *archiveName, int a, lineList *l)
+{
+  long long committed;
+  FILE *archive = openSnapshot(archiveName, &committed);
+  if(archive == NULL) return false;
+  memberTable t;
+  tableInit(&t);
+  bool ok = scanArchiveTo(archive, &t, committed);
+
+  //sort the members by name and position to find the latest of each name
+  mergeName *sorted = malloc((t.size+1)*sizeof(mergeName));
+  char *kinds = malloc(t.size+1);
+  for(int i=0;i<t.size;i++)
+  {
+    char *name = t.members[i].name;
+    kinds[i] = (t.members[i].kind != '\0') ? t.members[i].kind : '-';
+    if(name[0] != '\0' && name[strlen(name)-1] == '/') kinds[i] = 'd';
+    sorted[i].name = name;
+    sorted[i].archive = i;
+  }
+  if(ok)
+  {
+    for(int i=0;i<t.size;i++) removeTrailingSlashes(t.members[i].name);
+    qsort(sorted, t.size, sizeof(mergeName), compareMergeNames);
+  }
+
+  char line[MAXLEN+96];
+  for(int k=0;k<t.size && ok;k++)
+  {
+    if(k+1 < t.size && strcmp(sorted[k].name, sorted[k+1].name) == 0) continue;
+    int i = sorted[k].archive;
+    int j = resolveLink(archive, &t, i);
+    long long size = (j < 0) ? -1 : memberLength(archive, &t.members[j]);
+    if(size < 0) ok = false;
+    snprintf(line, sizeof(line), "%s\t%d\t%c\t%lld\t%lld\n", sorted[k].name, a,
+      kinds[i], size, t.members[i].offset);
+    linePush(l, line);
+  }
+  free(sorted);
+  free(kinds);
+  fclose(archive);
+  freeTable(&t);
+  return ok;
+}
+
+//Updates a catalog of the members of many archives. The catalog is a text
+//file listing the archives it indexes, followed by one line per member path
+//and archive (see catalogEntries) sorted by path, so that it can be searched
+//in place like look(1) does. Archives whose size and modification time are
+//unchanged keep their entries, which are copied over from the old catalog;
+//changed archives and the archives given in names are rescanned, and
+//archives that no longer exist are dropped. The new catalog is written to
+//CATALOG.bak and renamed over the catalog
+//returns EXIT_SUCCESS or EXIT_FAILURE
+int farCatalogUpdate(const char *catalogName, char *names[], int namesLen)
+{
+  catalogArchive *old = NULL;
+  int numOld = 0;
+  FILE *oldCatalog = fopen(catalogName, "r");
+  if(oldCatalog != NULL && !readCatalogHeader(oldCatalog, &old, &numOld))
+  {
+    freeCatalogArchives(old, numOld);
+    fclose(oldCatalog);
+    return FARERROR("Catalog %s is corrupted\n", catalogName);
+  }
+
+  //the archives of the new catalog: the old ones that still exist, then the
+  //new ones
+  catalogArchive *archives = calloc(numOld+namesLen+1, sizeof(catalogArchive));
+  int num = 0;
+  int newIndex[numOld+1];
+  for(int i=0;i<numOld+namesLen;i++)
+  {
+    char *name = (i < numOld) ? old[i].name : realpath(names[i-numOld], NULL);
+    struct stat buf;
+    if(i < numOld) newIndex[i] = -1;
+    if(name == NULL || stat(name, &buf) != 0)
+    {
+      if(i >= numOld)
+        fprintf(stderr, "Could not find archive %s\n", names[i-numOld]);
+      if(i >= numOld) free(name);
+      continue;
+    }
+    int k = 0;
+    while(k < num && strcmp(archives[k].name, name) != 0) k++;
+    if(k < num)
+    {
+      if(i >= numOld) free(name);
+      continue;
+    }
+
+    catalogArchive *a = &archives[num];
+    a->name = (i < numOld) ? strdup(name) : name;
+    a->size = buf.st_size;
+    a->sec = buf.st_mtim.tv_sec;
+    a->nsec = buf.st_mtim.tv_nsec;
+    a->oldIndex = (i < numOld) ? i : -1;
+    a->current = (i < numOld) && old[i].size == a->size &&
+      old[i].sec == a->sec && old[i].nsec == a->nsec;
+    if(i < numOld) newIndex[i] = num;
+    num++;
+  }
+
+  bool changed = (oldCatalog == NULL || num != numOld);
+  for(int k=0;k<num;k++) changed = changed || !archives[k].current;
+  if(!changed) //nothing to do
+  {
+    fclose(oldCatalog);
+    freeCatalogArchives(archives, num);
+    freeCatalogArchives(old, numOld);
+    return EXIT_SUCCESS;
+  }
+
+  lineList fresh = {NULL, 0, 0};
+  for(int k=0;k<num;k++)
+    if(!archives[k].current && !catalogEntries(archives[k].name, k, &fresh))
+    {
+      fprintf(stderr, "Could not index archive %s\n", archives[k].name);
+      archives[k].current = true; //leave its entries as they were
+      archives[k].size = -1; //but have it rescanned next time
+    }
+  qsort(fresh.lines, fresh.size, sizeof(char*), compareCatalogLines);
+
+  char newCatalogName[strlen(catalogName)+10];
+  strcpy(newCatalogName, catalogName);
+  strcat(newCatalogName, ".bak");
+  //a catalog that cannot be written is left as it was
+  FILE *catalog = fopen(newCatalogName, "w");
+  bool written = false;
+  if(catalog == NULL) fprintf(stderr, "Could not create %s\n", newCatalogName);
+  else
+  {
+    fprintf(catalog, "Far catalog %d\n", num);
+    for(int k=0;k<num;k++)
+      fprintf(catalog, "%lld\t%lld\t%lld\t%s\n", archives[k].size,
+        archives[k].sec, archives[k].nsec, archives[k].name);
+
+    //merge the kept entries of the old catalog with the new ones
+    char line[MAXLEN+96];
+    int f = 0;
+    bool more = oldCatalog != NULL;
+    while(more || f < fresh.size)
+    {
+      more = more && fgets(line, sizeof(line), oldCatalog) != NULL;
+      char *tab = more ? strchr(line, '\t') : NULL;
+      int a = (tab == NULL) ? -1 : atoi(tab+1);
+      bool keep = a >= 0 && a < numOld && newIndex[a] >= 0 &&
+        archives[newIndex[a]].current;
+      for(;f < fresh.size && (!more ||
+          compareCatalogPaths(fresh.lines[f], line) < 0);f++)
+        fputs(fresh.lines[f], catalog);
+      char *rest = keep ? strchr(tab+1, '\t') : NULL;
+      if(rest == NULL) continue;
+      *tab = '\0';
+      fprintf(catalog, "%s\t%d%s", line, newIndex[a], rest);
+    }
+
+    written = fclose(catalog) == 0;
+  }
+  if(written) rename(newCatalogName, catalogName);
+  if(oldCatalog != NULL) fclose(oldCatalog);
+  for(int i=0;i<fresh.size;i++) free(fresh.lines[i]);
+  free(fresh.lines);
+  freeCatalogArchives(archives, num);
+  freeCatalogArchives(old, numOld);
+  return written ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+//compares the catalog entry at line with key, where only the first keyLen
+//bytes of the entry are compared and a path ending before that compares as
+//less
+int compareCatalogKey(const char *line, const char *end, const char *key,
+  int keyLen)
+{
+  for(int i=0;i<keyLen;i++)
+  {
+    if(line+i == end || line[i] == '\n') return -1;
+    if(line[i] != key[i]) return ((unsigned char)line[i] <
+      (unsigned char)key[i]) ? -1 : 1;
+  }
+  return 0;
+}
+
+//Looks up a catalog: prints every entry whose path is path, or with under
+//set, every entry under the directory path. The entries are found by binary
+//search over the mapped catalog
+//returns EXIT_SUCCESS, or EXIT_FAILURE if the catalog cannot be read
+int farCatalogFind(const char *catalogName, const char *path, bool under)
+{
+  FILE *catalog = fopen(catalogName, "r");
+  if(catalog == NULL)
+    return FARERROR("Could not open catalog %s\n", catalogName);
+  catalogArchive *archives;
+  int num;
+  if(!readCatalogHeader(catalog, &archives, &num))
+  {
+    freeCatalogArchives(archives, num);
+    fclose(catalog);
+    return FARERROR("Catalog %s is corrupted\n", catalogName);
+  }
+  long long start = ftello(catalog);
+  struct stat buf;
+  fstat(fileno(catalog), &buf);
+  char *map = (buf.st_size == 0) ? NULL :
+    mmap(NULL, buf.st_size, PROT_READ, MAP_SHARED, fileno(catalog), 0);
+  fclose(catalog);
+  if(map == MAP_FAILED)
+  {
+    freeCatalogArchives(archives, num);
+    return FARERROR("Could not map catalog %s\n", catalogName);
+  }
+
+  //the key is "path\t", or "path/" for the entries under path
+  char key[MAXLEN+2];
+  int keyLen = snprintf(key, sizeof(key), "%s%c", path, under ? '/' : '\t');
+  if(under && strcmp(path, "") == 0) keyLen = 0;
+  char *end = map + buf.st_size;
+  char *low = map + start, *high = end;
+  while(low < high) //find the first entry not less than the key
+  {
+    char *mid = low + (high-low)/2;
+    while(mid > low && mid[-1] != '\n') mid--;
+    char *next = memchr(mid, '\n', end-mid);
+    next = (next == NULL) ? end : next+1;
+    if(compareCatalogKey(mid, end, key, keyLen) < 0) low = next;
+    else high = mid;
+  }
+
+  char entry[MAXLEN+96];
+  for(char *line=low;
+      line<end && compareCatalogKey(line, end, key, keyLen) == 0;)
+  {
+    int a;
+    char kind;
+    long long size, offset;
+    char *next = memchr(line, '\n', end-line);
+    if(next == NULL || next-line >= (long long)sizeof(entry)) break;
+    memcpy(entry, line, next-line); //the map is not null-terminated
+    entry[next-line] = '\0';
+    char *tab = strchr(entry, '\t');
+    if(tab == NULL ||
+       sscanf(tab, "\t%d\t%c\t%lld\t%lld", &a, &kind, &size, &offset) != 4 ||
+       a < 0 || a >= num) break;
+    *tab = '\0';
+    printf("%8lld %s%s in %s\n", size, entry, (kind == 'd') ? "/" : "",
+      archives[a].name);
+    line = next+1;
+  }
+
+  if(map != NULL) munmap(map, buf.st_size);
+  freeCatalogArchives(archives, num);
+  return EXIT_SUCCESS;
+}
+
+//directories and files watched by farWatch: fd is the inotify instance and
+//paths holds the path of each watch descriptor (NULL if it is not in use)
+typedef struct watchList_t
+{
+  int fd;
+  char **paths;
+  int size;
+} watchList;
+
+//adds inotify watches on path and, if it is a directory, on every directory
+//under it
+void watchTree(watchList *w, const char *path)
+{
+  int wd = inotify_add_watch(w->fd, path, WATCHEVENTS);
+  if(wd < 0)
+  {
+    if(errno != ENOENT) fprintf(stderr, "Could not watch %s\n", path);
+    return;
+  }
+  if(wd >= w->size)
+  {
+    w->paths = realloc(w->paths, (wd+1)*sizeof(char*));
+    for(int i=w->size;i<=wd;i++) w->paths[i] = NULL;
+    w->size = wd+1;
+  }
+  free(w->paths[wd]);
+  w->paths[wd] = strdup(path);
+
+  DIR *dir = opendir(path);
+  if(dir == NULL) return;
+  struct dirent *entry;
+  while((entry = readdir(dir)) != NULL)
+  {
+    if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+      continue;
+    char child[strlen(path)+strlen(entry->d_name)+2];
+    sprintf(child, "%s/%s", path, entry->d_name);
+    struct stat buf;
+    if(entry->d_type == DT_DIR || (entry->d_type == DT_UNKNOWN &&
+       lstat(child, &buf) == 0 && S_ISDIR(buf.st_mode)))
+      watchTree(w, child);
+  }
+  closedir(dir);
+}
+
+//brings the archive up to date with every name, as r does, and watches
+//them all again, which picks up whatever changes the watches missed
+void watchRescan(const char *archiveName, stack *names, watchList *w,
+  const options *opts)
+{
+  stack copy; //the names are added to as directories are walked
+  stackInit(&copy);
+  for(node *n=names->head;n!=NULL;n=n->next)
+  {
+    stackPush(&copy, n->name);
+    watchTree(w, n->name);
+  }
+  farRun(archiveName, &copy, 'r', opts);
+  freeStack(&copy);
+}
+
+//returns true if the dead members of the archive take more than WATCHSLACK
+//times the space of the live ones, so that rewriting it is worth it
+bool watchWasteful(const char *archiveName)
+{
+  long long committed, liveBytes = 0, deadBytes = 0;
+  memberTable t;
+  tableInit(&t);
+  FILE *archive = openSnapshot(archiveName, &committed);
+  if(archive != NULL && scanArchiveTo(archive, &t, committed))
+    measureLiveness(archive, &t, &liveBytes, &deadBytes);
+  if(archive != NULL) fclose(archive);
+  freeTable(&t);
+  return deadBytes > WATCHSLACK*liveBytes;
+}
+
+//appends the touched paths that exist to the archive in place and deletes
+//the members of those that no longer exist, then empties touched. the paths
+//of an append or delete that failed are put back in touched to be retried
+//returns true if nothing failed
+bool watchFlush(const char *archiveName, lineList *touched,
+  const options *opts)
+{
+  qsort(touched->lines, touched->size, sizeof(char*), compareNames);
+
+  //the archive and the files kept next to it are not archived: each flush
+  //rewrites some of them, which would make another flush
+  const char *suffixes[ARCHIVEFILES] = {"", ".idx", ".ckpt", ".ckpt.new",
+    ".bak"};
+  struct stat own[ARCHIVEFILES], buf;
+  char ownName[strlen(archiveName)+16];
+  for(int k=0;k<ARCHIVEFILES;k++)
+  {
+    sprintf(ownName, "%s%s", archiveName, suffixes[k]);
+    if(stat(ownName, &own[k]) != 0) memset(&own[k], 0, sizeof(own[k]));
+  }
+  stack present, missing;
+  stackInit(&present);
+  stackInit(&missing);
+  //pushed last to first, so that directories are archived before the
+  //paths under them, which are then found already archived
+  for(int i=touched->size-1;i>=0;i--)
+  {
+    char *name = touched->lines[i];
+    if(i > 0 && strcmp(name, touched->lines[i-1]) == 0) continue;
+    if(lstat(name, &buf) != 0)
+    {
+      stackPush(&missing, name);
+      continue;
+    }
+    bool archiveFile = false;
+    for(int k=0;k<ARCHIVEFILES && !archiveFile;k++)
+      archiveFile = buf.st_dev == own[k].st_dev && buf.st_ino == own[k].st_ino;
+    if(!archiveFile && (S_ISREG(buf.st_mode) || S_ISDIR(buf.st_mode)))
+      stackPush(&present, name);
+  }
+
+  //only names with members in the archive are deleted
+  stack deleted;
+  stackInit(&deleted);
+  memberTable t;
+  tableInit(&t);
+  long long committed;
+  FILE *archive = (missing.size > 0) ?
+    openSnapshot(archiveName, &committed) : NULL;
+  if(archive != NULL && scanArchiveTo(archive, &t, committed))
+    for(node *n=missing.head;n!=NULL;n=n->next)
+    {
+      bool member = false;
+      char temp[MAXLEN];
+      for(int i=0;i<t.size && !member;i++)
+      {
+        strcpy(temp, t.members[i].name);
+        removeTrailingSlashes(temp);
+        member = strcmp(temp, n->name) == 0 || checkPrefix(temp, n->name);
+      }
+      if(member) stackPush(&deleted, n->name);
+    }
+  if(archive != NULL) fclose(archive);
+  freeTable(&t);
+
+  bool deleteFailed = deleted.size > 0 &&
+    readArchive(archiveName, &deleted, 'd', opts) != 0;
+  bool appendFailed = present.size > 0 &&
+    appendToArchive(archiveName, &present, opts) != 0;
+  if(deleted.size > 0 || present.size > 0)
+    fprintf(stderr, "watch: %d archived, %d deleted%s\n",
+      appendFailed ? 0 : present.size, deleteFailed ? 0 : deleted.size,
+      (appendFailed || deleteFailed) ? ", retrying the rest" : "");
+
+  for(int i=0;i<touched->size;i++) free(touched->lines[i]);
+  touched->size = 0;
+  for(node *n=present.head;n!=NULL && appendFailed;n=n->next)
+    linePush(touched, n->name);
+  for(node *n=deleted.head;n!=NULL && deleteFailed;n=n->next)
+    linePush(touched, n->name);
+  freeStack(&present);
+  freeStack(&missing);
+  freeStack(&deleted);
+  return !appendFailed && !deleteFailed;
+}
+
+int farWatch(const char *archiveName, stack *names, const options *opts)
+{
+  //checked up front, as every flush would be refused
+  if(opts->times)
+  {
+    long long committed;
+    memberTable t;
+    tableInit(&t);
+    FILE *archive = openSnapshot(archiveName, &committed);
+    bool refused = archive != NULL && scanArchiveTo(archive, &t, committed) &&
+      timesRefused(&t, archiveName);
+    if(archive != NULL) fclose(archive);
+    freeTable(&t);
+    if(refused) return EXIT_FAILURE;
+  }
+
+  watchList w = {inotify_init1(IN_NONBLOCK | IN_CLOEXEC), NULL, 0};
+  if(w.fd < 0) return FARERROR("Could not start watching: %s\n",
+    strerror(errno));
+
+  //SIGINT and SIGTERM are taken as events, so that what is pending is
+  //archived before stopping. they are blocked in this thread only, and the
+  //mask it had is given back on return
+  sigset_t signals, oldMask;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, &oldMask);
+  int sigFd = signalfd(-1, &signals, SFD_CLOEXEC);
+  if(sigFd < 0)
+  {
+    pthread_sigmask(SIG_SETMASK, &oldMask, NULL);
+    close(w.fd);
+    return FARERROR("Could not start watching: %s\n", strerror(errno));
+  }
+  struct pollfd fds[2] = {{w.fd, POLLIN, 0}, {sigFd, POLLIN, 0}};
+
+  watchRescan(archiveName, names, &w, opts);
+
+  lineList touched = {NULL, 0, 0};
+  char *events = malloc(WATCHBUF);
+  double due = 0;
+  bool stop = false;
+  while(!stop)
+  {
+    int timeout = -1;
+    if(touched.size > 0)
+    {
+      double left = due - monotonicTime();
+      timeout = (left > 0) ? (int)(left*1000) + 1 : 0;
+    }
+    if(poll(fds, 2, timeout) < 0 && errno != EINTR) break;
+    if(fds[1].revents & POLLIN) stop = true;
+
+    bool overflow = false;
+    ssize_t len;
+    while((len = read(w.fd, events, WATCHBUF)) > 0)
+      for(char *p=events;p<events+len;)
+      {
+        struct inotify_event *e = (struct inotify_event*)p;
+        p += sizeof(struct inotify_event) + e->len;
+        if(e->mask & IN_Q_OVERFLOW) overflow = true;
+        if(e->wd < 0 || e->wd >= w.size || w.paths[e->wd] == NULL) continue;
+
+        char path[strlen(w.paths[e->wd])+e->len+2];
+        if(e->len > 0) sprintf(path, "%s/%s", w.paths[e->wd], e->name);
+        else strcpy(path, w.paths[e->wd]);
+        if(e->mask & IN_IGNORED)
+        {
+          free(w.paths[e->wd]);
+          w.paths[e->wd] = NULL;
+          continue;
+        }
+        if((e->mask & IN_ISDIR) && (e->mask & (IN_CREATE | IN_MOVED_TO)))
+          watchTree(&w, path);
+        if(touched.size == 0) due = monotonicTime() + opts->interval;
+        linePush(&touched, path);
+      }
+
+    if(overflow)
+    {
+      fprintf(stderr, "watch: event queue overflowed, rescanning\n");
+      for(int i=0;i<touched.size;i++) free(touched.lines[i]);
+      touched.size = 0;
+      watchRescan(archiveName, names, &w, opts);
+    }
+    else if(touched.size > 0 && (stop || monotonicTime() >= due))
+    {
+      //every flush appends whole new versions of the changed files, so the
+      //old ones are dropped by rewriting the archive once they pile up
+      if(!watchFlush(archiveName, &touched, opts))
+        due = monotonicTime() + opts->interval;
+      else if(!stop && watchWasteful(archiveName))
+      {
+        fprintf(stderr, "watch: compacting\n");
+        watchRescan(archiveName, names, &w, opts);
+      }
+    }
+  }
+
+  free(events);
+  free(touched.lines);
+  for(int i=0;i<w.size;i++) free(w.paths[i]);
+  free(w.paths);
+  close(w.fd);
+  close(fds[1].fd);
+  //the signals that stopped the watch are taken, so that unblocking them
+  //does not deliver them again
+  struct timespec now = {0, 0};
+  while(sigtimedwait(&signals, NULL, &now) > 0);
+  pthread_sigmask(SIG_SETMASK, &oldMask, NULL);
+  return EXIT_SUCCESS;
+}
+
+//latest member of a name in an archive compared by diff: name is the member
+//name without trailing slashes, index the position of the member in the
+//member table, and walked tells whether the path was met on disk
+typedef struct diffMember_t
+{
+  char *name;
+  int index;
+  bool walked;
+} diffMember;
+
+//state of a diff between an archive and the file system: the archive and its
+//member table, the latest member of every name sorted by name, the exclude
+//patterns, the lines reported, and counts of the paths walked and of the
+//files whose contents had to be compared
+typedef struct diffPass_t
+{
+  FILE *archive;
+  memberTable table;
+  diffMember *members;
+  int size;
+  excludeList exclude;
+  lineList lines;
+  bool corrupted;
+  long long walked;
+  long long compared;
+  long long comparedBytes;
+} diffPass;
+
+//qsort and bsearch comparison of diff members, by name and then by position
+int compareDiffMembers(const void *a, const void *b)
+{
+  const diffMember *x = a, *y = b;
+  int c = strcmp(x->name, y->name);
+  if(c != 0 || x->index < 0 || y->index < 0) return c;
+  return (x->index > y->index) - (x->index < y->index);
+}
+
+//qsort comparison of two diff lines by the path after their status
+int compareDiffLines(const void *a, const void *b)
+{
+  return strcmp(*(char* const*)a + 2, *(char* const*)b + 2);
+}
+
+//returns the latest member called name, or NULL if there is none
+diffMember *diffFind(diffPass *d, const char *name)
+{
+  diffMember key = {(char*)name, -1, false};
+  return bsearch(&key, d->members, d->size, sizeof(diffMember),
+    compareDiffMembers);
+}
+
+//records a difference: status is A (only on disk), D (only in the archive)
+//or M (changed)
+void diffReport(diffPass *d, char status, const char *path)
+{
+  char line[strlen(path)+3];
+  sprintf(line, "%c %s", status, path);
+  linePush(&d->lines, line);
+}
+
+//returns true if the next len bytes of streams a and b are the same
+bool sameBytes(FILE *a, FILE *b, long long len)
+{
+  char *x = malloc(COPYBUF), *y = malloc(COPYBUF);
+  bool same = true;
+  while(same && len > 0)
+  {
+    size_t n = (len < COPYBUF) ? len : COPYBUF;
+    same = fread(x, 1, n, a) == n && fread(y, 1, n, b) == n &&
+      memcmp(x, y, n) == 0;
+    len -= n;
+  }
+  free(x);
+  free(y);
+  return same;
+}
+
+//returns true if the file path holds the len bytes stored by the member at
+//index j of the archive (a delta is rebuilt into a temporary file first)
+bool sameContents(diffPass *d, int j, const char *path, long long len)
+{
+  FILE *file = fopen(path, "r");
+  if(file == NULL) return false;
+  d->compared++;
+  d->comparedBytes += len;
+  member *m = &d->table.members[j];
+  FILE *data = d->archive;
+  if(m->kind == DELTAMARK)
+  {
+    int b = findBase(&d->table, j);
+    data = (b < 0) ? NULL : tmpfile();
+    fseeko(d->archive, m->offset, SEEK_SET);
+    if(data != NULL &&
+       !applyDelta(d->archive, &d->table.members[b], m->size, data, NULL))
+    {
+      fclose(data);
+      data = NULL;
+    }
+    if(data == NULL) d->corrupted = true;
+    else rewind(data);
+  }
+  else fseeko(d->archive, m->offset, SEEK_SET);
+  bool same = data != NULL && sameBytes(data, file, len);
+  if(data != NULL && data != d->archive) fclose(data);
+  fclose(file);
+  return same;
+}
+
+//compares path, and everything under it if it is a directory, with the
+//archive: paths that are not regular files or directories are skipped, as r
+//skips them. the contents of a file are read only if its size matches its
+//member and its mtime was not recorded or differs
+void diffPath(diffPass *d, const char *path)
+{
+  struct stat buf;
+  if(isExcluded(&d->exclude, path) || lstat(path, &buf) != 0) return;
+  if(!S_ISREG(buf.st_mode) && !S_ISDIR(buf.st_mode)) return;
+  d->walked++;
+
+  diffMember *found = diffFind(d, path);
+  if(found == NULL) diffReport(d, 'A', path);
+  else
+  {
+    found->walked = true;
+    member *m = &d->table.members[found->index];
+    int j = resolveLink(d->archive, &d->table, found->index);
+    long long len = (j < 0) ? -1 :
+      memberLength(d->archive, &d->table.members[j]);
+    if(len < 0) d->corrupted = true;
+    bool directory = m->name[strlen(m->name)-1] == '/';
+    long long mtime = buf.st_mtim.tv_sec*1000000000LL + buf.st_mtim.tv_nsec;
+    if(directory != S_ISDIR(buf.st_mode)) diffReport(d, 'M', path);
+    else if(!directory && len != buf.st_size) diffReport(d, 'M', path);
+    else if(!directory && m->mtime != mtime && len >= 0 &&
+            !sameContents(d, j, path, len)) diffReport(d, 'M', path);
+  }
+
+  DIR *dir = S_ISDIR(buf.st_mode) ? opendir(path) : NULL;
+  if(dir == NULL) return;
+  int len;
+  dirEntry *entries = listDirectory(dir, path, &d->exclude, false, &len);
+  closedir(dir);
+  for(int i=0;i<len;i++)
+  {
+    char child[strlen(path)+strlen(entries[i].name)+2];
+    sprintf(child, "%s/%s", path, entries[i].name);
+    diffPath(d, child);
+    free(entries[i].name);
+  }
+  free(entries);
+}
+
+//returns true if path or a directory above it is excluded
+bool diffExcluded(diffPass *d, const char *path)
+{
+  char temp[strlen(path)+1];
+  strcpy(temp, path);
+  for(char *slash=temp+strlen(temp);slash!=NULL;slash=strrchr(temp, '/'))
+  {
+    *slash = '\0';
+    if(temp[0] != '\0' && isExcluded(&d->exclude, temp)) return true;
+  }
+  return false;
+}
+
+//Compares the archive with the file system without extracting it. The
+//member headers are read (up to the committed length if the archive has an
+//index), the named paths are walked with lstat, and a line is printed for
+//every path that is only on disk (A), only in the archive (D) or changed
+//(M), sorted by path. A file is changed if its type or size differ from its
+//latest member; when they match, the mtime recorded with the times option
+//decides, and only if it was not recorded or differs are the contents read
+//and compared with the member's. Without names every member is compared,
+//and the directories at the top of the archive are walked
+//returns 0 if nothing differs, 1 if something does, 2 on error
+int farDiff(const char *archiveName, stack *names, const options *opts)
+{
+  diffPass d;
+  long long committed;
+  d.archive = openSnapshot(archiveName, &committed);
+  if(d.archive == NULL)
+  {
+    fprintf(stderr, "Could not open archive %s\n", archiveName);
+    return 2;
+  }
+  tableInit(&d.table);
+  if(!scanArchiveTo(d.archive, &d.table, committed))
+  {
+    fprintf(stderr, "Archive %s is corrupted\n", archiveName);
+    fclose(d.archive);
+    freeTable(&d.table);
+    return 2;
+  }
+
+  //keep the latest member of every name
+  d.members = malloc((d.table.size+1)*sizeof(diffMember));
+  for(int i=0;i<d.table.size;i++)
+  {
+    d.members[i].name = strdup(d.table.members[i].name);
+    removeTrailingSlashes(d.members[i].name);
+    d.members[i].index = i;
+    d.members[i].walked = false;
+  }
+  qsort(d.members, d.table.size, sizeof(diffMember), compareDiffMembers);
+  d.size = 0;
+  for(int i=0;i<d.table.size;i++)
+  {
+    if(i+1 < d.table.size &&
+       strcmp(d.members[i].name, d.members[i+1].name) == 0)
+      free(d.members[i].name);
+    else d.members[d.size++] = d.members[i];
+  }
+  excludeCompile(&d.exclude, opts->exclude, opts->excludeLen);
+  d.lines = (lineList){NULL, 0, 0};
+  d.corrupted = false;
+  d.walked = d.compared = d.comparedBytes = 0;
+
+  //without names, the members whose directory is not a member are walked
+  char prefix[MAXLEN];
+  bool all = (names == NULL || names->size == 0);
+  if(!all)
+    for(node *n=names->head;n!=NULL;n=n->next) diffPath(&d, n->name);
+  for(int i=0;i<d.size && all;i++)
+  {
+    char parent[strlen(d.members[i].name)+1];
+    strcpy(parent, d.members[i].name);
+    char *slash = strrchr(parent, '/');
+    if(slash != NULL && slash != parent) *slash = '\0';
+    if(slash == NULL || slash == parent || diffFind(&d, parent) == NULL)
+      diffPath(&d, d.members[i].name);
+  }
+
+  for(int i=0;i<d.size;i++)
+  {
+    char *name = d.members[i].name;
+    if(!d.members[i].walked &&
+       (all || isNameInStack(names, name) ||
+        stackHasPrefix(names, name, prefix)) && !diffExcluded(&d, name))
+      diffReport(&d, 'D', name);
+  }
+
+  qsort(d.lines.lines, d.lines.size, sizeof(char*), compareDiffLines);
+  for(int i=0;i<d.lines.size;i++)
+  {
+    printf("%s\n", d.lines.lines[i]);
+    free(d.lines.lines[i]);
+  }
+  if(opts->stats)
+    fprintf(stderr, "{\"mode\": \"diff\", \"members\": %d, \"walked\": %lld, "
+      "\"differences\": %d, \"contents_compared\": %lld, "
+      "\"bytes_compared\": %lld}\n", d.size, d.walked, d.lines.size,
+      d.compared, d.comparedBytes);
+  if(d.corrupted) fprintf(stderr, "Archive %s is corrupted\n", archiveName);
+
+  int status = d.corrupted ? 2 : (d.lines.size > 0);
+  for(int i=0;i<d.size;i++) free(d.members[i].name);
+  free(d.members);
+  free(d.lines.lines);
+  freeExcludes(&d.exclude);
+  freeTable(&d.table);
+  fclose(d.archive);
+  return status;
+}
+
+//Tells whether names are in the archive, for scripts that probe archives
+//often. A name is in the archive if a member has it or is under it. Names
+//that the Bloom filter in the index of the archive rules out are answered
+//without reading the archive; the others are looked up in a member index
+//built from the member headers (up to the committed length), which are read
+//once and only if a name needs them. A line "present name" or "absent name"
+//is printed for every name, in the order given
+//returns 0 if every name is present, 1 if some are not, 2 on error
+int farProbe(const char *archiveName, stack *names, const options *opts)
+{
+  sidecar sc;
+  long long committed;
+  FILE *archive = openIndexed(archiveName, &sc, &committed);
+  if(archive == NULL)
+  {
+    sidecarClose(&sc);
+    fprintf(stderr, "Could not open archive %s\n", archiveName);
+    return 2;
+  }
+
+  //the stack holds the names in reverse order
+  node *order[names->size+1];
+  int numNames = 0;
+  for(node *n=names->head;n!=NULL;n=n->next) order[numNames++] = n;
+
+  memberIndex ix;
+  indexInit(&ix);
+  bool indexed = false, ok = true;
+  int absent = 0, ruledOut = 0;
+  char first[MAXLEN];
+  for(int k=numNames-1;k>=0 && ok;k--)
+  {
+    const char *name = order[k]->name;
+    bool present = bloomMayHave(&sc.filter, name);
+    ruledOut += !present;
+    if(present && !indexed)
+    {
+      memberTable t;
+      tableInit(&t);
+      ok = scanArchiveTo(archive, &t, committed);
+      if(ok) indexBuild(&ix, &t);
+      freeTable(&t);
+      indexed = true;
+    }
+    if(present && ok)
+    {
+      char under[strlen(name)+2];
+      sprintf(under, "%s/", name);
+      int id = nameTableSeek(&ix.names, under, first);
+      present = nameTableFind(&ix.names, name) >= 0 ||
+        (id < ix.names.size && strncmp(first, under, strlen(under)) == 0);
+    }
+    if(ok) printf("%s %s\n", present ? "present" : "absent", name);
+    absent += !present;
+  }
+  if(!ok) fprintf(stderr, "Archive %s is corrupted\n", archiveName);
+  if(opts->stats)
+    fprintf(stderr, "{\"mode\": \"probe\", \"names\": %d, \"ruled_out\": %d, "
+      "\"headers_read\": %s}\n", numNames, ruledOut,
+      indexed ? "true" : "false");
+
+  freeIndex(&ix);
+  sidecarClose(&sc);
+  fclose(archive);
+  return !ok ? 2 : (absent > 0);
+}
+
+//prints s as a JSON string on stdout, escaping quotes, backslashes and
+//control characters
+void printJsonString(const char *s)
+{
+  putchar('"');
+  for(;*s != '\0';s++)
+  {
+    if(*s == '"' || *s == '\\') printf("\\%c", *s);
+    else if((unsigned char)*s < 0x20) printf("\\u%04x", *s);
+    else putchar(*s);
+  }
+  putchar('"');
+}
+
+//prints the bucket of the member size histogram of info holding sizes from
+//2^(k-1) up to 2^k (k 0 holds empty members) as a JSON key and count
+void printSizeBucket(int k, long long count, bool first)
+{
+  const char *units = "BKMGTPE";
+  long long low = (k == 0) ? 0 : 1LL << (k-1);
+  int unit = 0;
+  for(;low >= 1024 && low % 1024 == 0;low /= 1024) unit++;
+  printf("%s\"%lld%c\": %lld", first ? "" : ", ", low, units[unit], count);
+}
+
+//Reports how the space of the archive is used, to tell when it is worth
+//compacting or laying out differently. Only the member headers are read, in
+//one pass that seeks over the member data, up to the committed length when
+//the archive has an index (whose filter is described too). A member is live
+//if it is the latest of its name or holds the data of a live link or delta;
+//every other member, and whatever lies past the committed length, is dead.
+//Header bytes include the padding put in by the align option, which is also
+//given on its own. The report is a JSON object on stdout
+//returns EXIT_SUCCESS or EXIT_FAILURE
+int farInfo(const char *archiveName)
+{
+  sidecar sc;
+  long long committed;
+  FILE *archive = openIndexed(archiveName, &sc, &committed);
+  if(archive == NULL)
+  {
+    sidecarClose(&sc);
+    return FARERROR("Could not open archive %s\n", archiveName);
+  }
+  struct stat buf;
+  memberTable t;
+  tableInit(&t);
+  if(fstat(fileno(archive), &buf) != 0 ||
+     !scanArchiveTo(archive, &t, committed))
+  {
+    sidecarClose(&sc);
+    fclose(archive);
+    freeTable(&t);
+    return FARERROR("Archive %s is corrupted\n", archiveName);
+  }
+
+  long long histogram[INFOBUCKETS] = {0};
+  long long headerBytes = 0, paddingBytes = 0, dataBytes = 0, nameBytes = 0;
+  int kinds[4] = {0}; //plain files, directories, links, deltas
+  int timed = 0;
+  char digits[64];
+  for(int i=0;i<t.size;i++)
+  {
+    member *m = &t.members[i];
+    long long start = (i == 0) ? 0 : t.members[i-1].offset +
+      t.members[i-1].size;
+    long long len = strlen(m->name);
+    long long minimal = len + 1 + (m->kind != '\0') +
+      sprintf(digits, "%lld|", m->size);
+    if(m->mtime >= 0)
+    {
+      minimal += sprintf(digits, "%c%lld ", TIMEMARK, m->mtime);
+      timed++;
+    }
+    headerBytes += m->offset - start;
+    paddingBytes += m->offset - start - minimal;
+    dataBytes += m->size;
+    bool dir = len > 0 && m->name[len-1] == '/';
+    nameBytes += len - dir;
+    kinds[dir ? 1 : (m->kind == LINKMARK) ? 2 :
+      (m->kind == DELTAMARK) ? 3 : 0]++;
+    if(dir) continue;
+    int k = 0;
+    while(k < INFOBUCKETS-1 && (m->size >> k) > 0) k++;
+    histogram[k]++;
+  }
+
+  long long liveBytes, deadBytes;
+  measureLiveness(archive, &t, &liveBytes, &deadBytes);
+  memberIndex ix;
+  indexInit(&ix);
+  indexBuild(&ix, &t);
+  long long end = (committed >= 0) ? committed : buf.st_size;
+
+  printf("{\"archive\": ");
+  printJsonString(archiveName);
+  printf(", \"bytes\": %lld, \"committed_bytes\": %lld, "
+    "\"members\": %d, \"names\": %d, \"files\": %d, \"directories\": %d, "
+    "\"links\": %d, \"deltas\": %d, \"members_with_times\": %d, "
+    "\"live_bytes\": %lld, \"dead_bytes\": %lld, \"unpublished_bytes\": %lld, "
+    "\"header_bytes\": %lld, \"padding_bytes\": %lld, \"data_bytes\": %lld, "
+    "\"average_name_length\": %.1f, \"size_histogram\": {",
+    (long long)buf.st_size, end, t.size, ix.names.size, kinds[0], kinds[1],
+    kinds[2], kinds[3], timed, liveBytes, deadBytes,
+    (long long)buf.st_size - end, headerBytes, paddingBytes, dataBytes,
+    (t.size > 0) ? (double)nameBytes/t.size : 0.0);
+  bool first = true;
+  for(int k=0;k<INFOBUCKETS;k++)
+    if(histogram[k] > 0)
+    {
+      printSizeBucket(k, histogram[k], first);
+      first = false;
+    }
+  printf("}, \"bloom\": ");
+
+  //the chance of a false positive is the fraction of bits set to the power
+  //of the number of hashes
+  bloomFilter *f = &sc.filter;
+  if(f->bits == NULL) printf("null}\n");
+  else
+  {
+    long long set = 0;
+    for(long long i=0;i<f->size/8;i++) set += __builtin_popcount(f->bits[i]);
+    double rate = 1;
+    for(int i=0;i<f->hashes;i++) rate *= (double)set/f->size;
+    printf("{\"bits\": %lld, \"hashes\": %d, \"names\": %lld, "
+      "\"bits_set\": %lld, \"false_positive_rate\": %.3g}}\n", f->size,
+      f->hashes, f->names, set, rate);
+  }
+
+  freeIndex(&ix);
+  freeTable(&t);
+  sidecarClose(&sc);
+  fclose(archive);
+  return EXIT_SUCCESS;
+}
+
+//sets every option to its default
+void optionsInit(options *opts)
+{
+  opts->delta = false;
+  opts->nocache = false;
+  opts->direct = false;
+  opts->cacheReport = false;
+  opts->inodeOrder = false;
+  opts->rangeOffset = 0;
+  opts->rangeLength = -1;
+  opts->firstWins = false;
+  opts->align = 0;
+  opts->readers = 0;
+  opts->readAheadBytes = 64<<20;
+  opts->checkpoint = 0;
+  opts->throttleBytes = 0;
+  opts->throttleOps = 0;
+  opts->interval = 5;
+  opts->exclude = NULL;
+  opts->excludeLen = 0;
+  opts->stats = false;
+  opts->preallocate = true;
+  opts->concurrent = false;
+  opts->times = false;
+  opts->bloom = false;
+  opts->durability = DURABLENONE;
+}
+
+//runs one Far command: mode is r, x, d, t, p or m, and names holds the names
+//given on the command line (an empty stack selects every member for x)
+//returns 0 if there is no error, -1 if the archive is corrupted
+int farRun(const char *archiveName, stack *names, char mode,
+  const options *opts)
+{
+  int namesLen = (names == NULL) ? 0 : names->size;
+  if(mode == 'r' || mode == 'd')
+  {
+    if(namesLen == 0) return 0;
+    if(mode == 'r' && opts->delta)
+      return appendToArchive(archiveName, names, opts);
+    return readArchive(archiveName, names, mode, opts);
+  }
+  if(mode == 'p')
+    return (namesLen == 0) ? 0 : printMembers(archiveName, names, opts);
+  if(mode == 'm')
+    return (namesLen == 0) ? 0 : mergeArchives(archiveName, names, opts);
+  if(mode == 'x' && namesLen > 0)
+    return readArchive(archiveName, names, mode, opts);
+  return readArchive(archiveName, NULL, mode, opts);
+}
+
+//an open archive: its name, the options it was opened with, the archive file
+//open for reading and its member table
+struct farArchive_t
+{
+  char *name;
+  options opts;
+  FILE *file;
+  memberTable table;
+};
+
+//rereads the member table of an open archive after it was changed
+//returns false if the archive cannot be read or is corrupted
+bool farReload(farArchive *ar)
+{
+  if(ar->file != NULL) fclose(ar->file);
+  freeTable(&ar->table);
+  long long committed;
+  ar->file = openSnapshot(ar->name, &committed);
+  return ar->file != NULL && scanArchiveTo(ar->file, &ar->table, committed);
+}
+
+//opens an archive and reads its member table, creating an empty archive if
+//create is set and the file does not exist
+//returns NULL if the archive cannot be opened or is corrupted
+farArchive *farOpen(const char *archiveName, const options *opts,
+  bool create)
+{
+  if(create)
+  {
+    int fd = open(archiveName, O_WRONLY | O_CREAT, 0666);
+    if(fd < 0) return NULL;
+    close(fd);
+  }
+
+  farArchive *ar = malloc(sizeof(farArchive));
+  ar->name = malloc(strlen(archiveName)+1);
+  strcpy(ar->name, archiveName);
+  if(opts != NULL) ar->opts = *opts;
+  else optionsInit(&ar->opts);
+  ar->file = NULL;
+  tableInit(&ar->table);
+  if(!farReload(ar))
+  {
+    farClose(ar);
+    return NULL;
+  }
+  return ar;
+}
+
+//closes an archive handle and frees everything it holds
+void farClose(farArchive *ar)
+{
+  if(ar->file != NULL) fclose(ar->file);
+  freeTable(&ar->table);
+  free(ar->name);
+  free(ar);
+}
+
+//starts an iteration over the members of an archive, in archive order
+void farIterInit(farIter *it, farArchive *ar)
+{
+  it->archive = ar;
+  it->next = 0;
+}
+
+//returns the next member, or NULL after the last one
+const member *farIterNext(farIter *it)
+{
+  if(it->next >= it->archive->table.size) return NULL;
+  return &it->archive->table.members[it->next++];
+}
+
+//state behind a stream opened on a plain member: a descriptor of its own on
+//the archive, the range of the member data and the read position in it
+typedef struct memberStream_t
+{
+  int fd;
+  long long offset;
+  long long size;
+  long long pos;
+} memberStream;
+
+//fopencookie read function of a member stream
+ssize_t memberStreamRead(void *cookie, char *buf, size_t len)
+{
+  memberStream *ms = cookie;
+  if((long long)len > ms->size - ms->pos) len = ms->size - ms->pos;
+  ssize_t n = pread(ms->fd, buf, len, ms->offset + ms->pos);
+  if(n > 0) ms->pos += n;
+  return n;
+}
+
+//fopencookie seek function of a member stream
+int memberStreamSeek(void *cookie, off64_t *offset, int whence)
+{
+  memberStream *ms = cookie;
+  long long pos = *offset;
+  if(whence == SEEK_CUR) pos += ms->pos;
+  else if(whence == SEEK_END) pos += ms->size;
+  if(pos < 0) return -1;
+  ms->pos = pos;
+  *offset = pos;
+  return 0;
+}
+
+//fopencookie close function of a member stream
+int memberStreamClose(void *cookie)
+{
+  memberStream *ms = cookie;
+  close(ms->fd);
+  free(ms);
+  return 0;
+}
+
+//opens the contents of the member called name (the latest version if the
+//name occurs more than once) as a read-only stream. plain members are read
+//in place; deltas are rebuilt into a temporary file
+//returns NULL if there is no such member or the archive is corrupted
+FILE *farOpenMember(farArchive *ar, const char *name)
+{
+  char temp[MAXLEN];
+  strncpy(temp, name, MAXLEN-1);
+  temp[MAXLEN-1] = '\0';
+  removeTrailingSlashes(temp);
+
+  int i = tableFind(&ar->table, temp);
+  if(i < 0) return NULL;
+  int j = resolveLink(ar->file, &ar->table, i);
+  if(j < 0) return NULL;
+  member *m = &ar->table.members[j];
+
+  if(m->kind == DELTAMARK)
+  {
+    int b = findBase(&ar->table, j);
+    FILE *out = (b < 0) ? NULL : tmpfile();
+    if(out == NULL) return NULL;
+    fseeko(ar->file, m->offset, SEEK_SET);
+    if(!applyDelta(ar->file, &ar->table.members[b], m->size, out, NULL))
+    {
+      fclose(out);
+      return NULL;
+    }
+    rewind(out);
+    return out;
+  }
+
+  memberStream *ms = malloc(sizeof(memberStream));
+  ms->fd = dup(fileno(ar->file));
+  ms->offset = m->offset;
+  ms->size = m->size;
+  ms->pos = 0;
+  cookie_io_functions_t io =
+    {memberStreamRead, NULL, memberStreamSeek, memberStreamClose};
+  FILE *stream = (ms->fd < 0) ? NULL : fopencookie(ms, "r", io);
+  if(stream == NULL)
+  {
+    if(ms->fd >= 0) close(ms->fd);
+    free(ms);
+  }
+  return stream;
+}
+
+//reads up to len bytes of the member called name (the latest version if the
+//name occurs more than once) from offset into buf. plain members are read
+//straight from their place in the archive; for deltas only the instructions
+//overlapping the range are applied
+//returns the number of bytes read, which is short only at the end of the
+//member, or -1 if there is no such member or the archive is corrupted
+long long farReadRange(farArchive *ar, const char *name, void *buf,
+  long long len, long long offset)
+{
+  char temp[MAXLEN];
+  strncpy(temp, name, MAXLEN-1);
+  temp[MAXLEN-1] = '\0';
+  removeTrailingSlashes(temp);
+
+  int i = tableFind(&ar->table, temp);
+  int j = (i < 0) ? -1 : resolveLink(ar->file, &ar->table, i);
+  if(j < 0 || offset < 0 || len < 0) return -1;
+  member *m = &ar->table.members[j];
+  long long fileLen = memberLength(ar->file, m);
+  if(fileLen < 0) return -1;
+  clipRange(fileLen, &offset, &len);
+
+  if(m->kind != DELTAMARK)
+  {
+    for(long long done=0;done<len;)
+    {
+      ssize_t n = pread(fileno(ar->file), (char*)buf + done, len - done,
+        m->offset + offset + done);
+      if(n < 0 && errno == EINTR) continue;
+      if(n <= 0) return -1;
+      done += n;
+    }
+    return len;
+  }
+
+  int b = findBase(&ar->table, j);
+  FILE *out = (b < 0 || len == 0) ? NULL : fmemopen(buf, len, "w");
+  if(out == NULL) return (b < 0) ? -1 : 0;
+  setbuf(out, NULL);
+  fseeko(ar->file, m->offset, SEEK_SET);
+  bool rebuilt = applyDeltaRange(ar->file, &ar->table.members[b], m->size,
+    offset, len, out, NULL);
+  fclose(out);
+  return rebuilt ? len : -1;
+}
+
+//appends the file or directory path to the archive, in place
+//returns 0 if there is no error, -1 otherwise
+int farAppend(farArchive *ar, const char *path)
+{
+  stack names;
+  stackInit(&names);
+  stackPush(&names, path);
+  if(strcmp(path, "/") != 0) removeTrailingSlashes(names.head->name);
+
+  int j = appendToArchive(ar->name, &names, &ar->opts);
+  freeStack(&names);
+  if(!farReload(ar)) return -1;
+  return j;
+}
+
+//deletes every member called name, or under the directory name
+//returns 0 if there is no error, -1 if there is no such member or the
+//archive is corrupted
+int farDelete(farArchive *ar, const char *name)
+{
+  stack names;
+  stackInit(&names);
+  stackPush(&names, name);
+  removeTrailingSlashes(names.head->name);
+
+  bool present = false;
+  char temp[MAXLEN];
+  for(int i=0;i<ar->table.size && !present;i++)
+  {
+    strcpy(temp, ar->table.members[i].name);
+    removeTrailingSlashes(temp);
+    present = strcmp(temp, names.head->name) == 0 ||
+      checkPrefix(temp, names.head->name);
+  }
+
+  int j = present ? readArchive(ar->name, &names, 'd', &ar->opts) : -1;
+  freeStack(&names);
+  if(!farReload(ar)) return -1;
+  return j;
+}